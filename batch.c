@@ -0,0 +1,228 @@
+/* Host batch renderer: many sheets (or .mid files) to WAV at once.
+   A work-stealing pool of threads takes two kinds of task: parsing a file,
+   and synthesizing one time segment of a parsed score. A parse task cuts
+   its score into segments and pushes them onto its own deque, where idle
+   threads steal them; the thread that finishes a file's last segment
+   stitches the segments into the WAV. Every segment renders on its own
+   Synth (synth_render_score), so the result is sample-identical to
+   `music3 file -w file.wav`.
+
+   Usage: m3batch [-j threads] [-r rate] [-s segment_sec] files...
+   Each input x.txt / x.mid is written as x.wav next to it.
+*/
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>  /* sysconf */
+#include "music3.h"
+
+const M3Io *g_io;                        /* unused: nothing here touches a backend */
+
+/* ===== Jobs: one per input file ===== */
+typedef struct { short *pcm; unsigned long n, cap; } SegBuf;
+
+typedef struct {
+    const char *in;
+    char out[512];
+    Score sc;
+    unsigned long seg_ms;
+    unsigned nseg, done;
+    SegBuf *seg;
+    pthread_mutex_t lock;
+    int ok;
+} Job;
+
+typedef struct { Job *job; int seg; } Task;     /* seg < 0: parse */
+
+/* ===== Work-stealing deques: the owner works the bottom, thieves take the top ===== */
+typedef struct {
+    Task *t;
+    unsigned long top, bot, cap;         /* live tasks are t[top % cap .. bot % cap) */
+    pthread_mutex_t m;
+} Deque;
+
+static Deque *g_dq;
+static unsigned g_nthreads;
+static unsigned g_rate = 22050U;
+static unsigned long g_seg_ms = 10000UL;
+
+static pthread_mutex_t g_idle_m = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_idle_cv = PTHREAD_COND_INITIALIZER;
+static unsigned long g_pending = 0;      /* queued or running tasks */
+static unsigned long g_steals = 0;
+
+static void dq_push(unsigned w, Job *job, int seg){
+    Deque *d = &g_dq[w];
+    pthread_mutex_lock(&g_idle_m); g_pending++; pthread_mutex_unlock(&g_idle_m);
+    pthread_mutex_lock(&d->m);
+    if(d->bot - d->top == d->cap){
+        unsigned long ncap = d->cap ? d->cap * 2UL : 64UL, i;
+        Task *nt = (Task*)malloc(ncap * sizeof(Task));
+        if(!nt){ fprintf(stderr, "out of memory\n"); exit(1); }
+        for(i = d->top; i < d->bot; i++) nt[i % ncap] = d->t[i % d->cap];
+        free(d->t); d->t = nt; d->cap = ncap;
+    }
+    d->t[d->bot % d->cap].job = job; d->t[d->bot % d->cap].seg = seg;
+    d->bot++;
+    pthread_mutex_unlock(&d->m);
+    pthread_cond_signal(&g_idle_cv);
+}
+
+/* own deque newest-first (what this thread just made is warm in cache),
+   then steal the oldest task of the others */
+static int dq_take(unsigned w, Task *out){
+    unsigned i;
+    Deque *d = &g_dq[w];
+    pthread_mutex_lock(&d->m);
+    if(d->bot > d->top){ *out = d->t[--d->bot % d->cap]; pthread_mutex_unlock(&d->m); return 1; }
+    pthread_mutex_unlock(&d->m);
+    for(i=1; i<g_nthreads; i++){
+        d = &g_dq[(w + i) % g_nthreads];
+        pthread_mutex_lock(&d->m);
+        if(d->bot > d->top){
+            *out = d->t[d->top++ % d->cap];
+            pthread_mutex_unlock(&d->m);
+            pthread_mutex_lock(&g_idle_m); g_steals++; pthread_mutex_unlock(&g_idle_m);
+            return 1;
+        }
+        pthread_mutex_unlock(&d->m);
+    }
+    return 0;
+}
+
+static void task_done(void){
+    pthread_mutex_lock(&g_idle_m);
+    if(--g_pending == 0) pthread_cond_broadcast(&g_idle_cv);
+    pthread_mutex_unlock(&g_idle_m);
+}
+
+/* ===== Tasks ===== */
+static void seg_sink(void *ctx, const short *pcm, unsigned n){
+    SegBuf *b = (SegBuf*)ctx;
+    if(b->n + n > b->cap){
+        unsigned long ncap = b->cap ? b->cap * 2UL : 65536UL;
+        short *np;
+        while(ncap < b->n + n) ncap *= 2UL;
+        if((np = (short*)realloc(b->pcm, ncap * sizeof(short))) == 0){ fprintf(stderr, "out of memory\n"); exit(1); }
+        b->pcm = np; b->cap = ncap;
+    }
+    memcpy(b->pcm + b->n, pcm, n * sizeof(short));
+    b->n += n;
+}
+
+static void stitch(Job *j){
+    FILE *f = wav_open(j->out, g_rate);
+    unsigned long frames = 0;
+    unsigned i;
+    if(f){
+        for(i=0;i<j->nseg;i++){
+            unsigned long k;
+            for(k=0; k < j->seg[i].n; k += 4096UL) wav_write(f, j->seg[i].pcm + k, (unsigned)(j->seg[i].n - k > 4096UL ? 4096UL : j->seg[i].n - k));
+            frames += j->seg[i].n;
+        }
+        j->ok = wav_close(f, frames);
+    }
+    printf("%s -> %s: %lu voices, %lu ms, %u segment(s)%s\n", j->in, j->out, (unsigned long)j->sc.nv, j->sc.len, j->nseg, j->ok ? "" : "  [write failed]");
+    for(i=0;i<j->nseg;i++) free(j->seg[i].pcm);
+    free(j->seg); j->seg = 0;
+    score_free(&j->sc);
+}
+
+static void run_parse(unsigned w, Job *j){
+    unsigned i;
+    if(!load_score(j->in, &j->sc)){ printf("%s: %s\n", j->in, j->sc.err ? j->sc.err : "cannot read score"); return; }
+    /* every segment replays the score up to its start without mixing, so
+       keep it to a few segments per thread; the last also carries the tail */
+    j->seg_ms = g_seg_ms;
+    if(j->sc.len / j->seg_ms >= 4UL * g_nthreads) j->seg_ms = j->sc.len / (4UL * g_nthreads) + 1UL;
+    j->nseg = (unsigned)(j->sc.len / j->seg_ms) + 1U;
+    if((j->seg = (SegBuf*)calloc(j->nseg, sizeof(SegBuf))) == 0){ fprintf(stderr, "out of memory\n"); exit(1); }
+    for(i=j->nseg; i-- > 0; ) dq_push(w, j, (int)i);   /* segment 0 ends up on top for this thread */
+}
+
+static void run_segment(Job *j, unsigned k){
+    Synth syn;
+    int last;
+    synth_init(&syn, g_rate);
+    synth_render_score(&syn, &j->sc, (unsigned long)k * j->seg_ms, k + 1U == j->nseg ? 0UL : (unsigned long)(k + 1U) * j->seg_ms, seg_sink, &j->seg[k]);
+    pthread_mutex_lock(&j->lock);
+    last = (++j->done == j->nseg);
+    pthread_mutex_unlock(&j->lock);
+    if(last) stitch(j);
+}
+
+static void *worker(void *arg){
+    unsigned w = (unsigned)(size_t)arg;
+    Task t;
+    for(;;){
+        if(dq_take(w, &t)){
+            if(t.seg < 0) run_parse(w, t.job); else run_segment(t.job, (unsigned)t.seg);
+            task_done();
+            continue;
+        }
+        pthread_mutex_lock(&g_idle_m);
+        if(g_pending == 0){ pthread_mutex_unlock(&g_idle_m); return 0; }
+        {   /* work is running elsewhere and may spawn more; wake on a push or soon after */
+            struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 2000000L; if(ts.tv_nsec >= 1000000000L){ ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+            pthread_cond_timedwait(&g_idle_cv, &g_idle_m, &ts);
+        }
+        pthread_mutex_unlock(&g_idle_m);
+    }
+}
+
+static double mono_s(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv){
+    Job *jobs;
+    pthread_t *th;
+    unsigned njobs = 0, i;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    double t;
+    int a;
+
+    g_nthreads = ncpu > 0 ? (unsigned)ncpu : 1U;
+    if((jobs = (Job*)calloc((size_t)argc, sizeof(Job))) == 0) return 1;
+    for(a=1;a<argc;a++){
+        if(strcmp(argv[a],"-j")==0 && a+1<argc) g_nthreads = (unsigned)atoi(argv[++a]);
+        else if(strcmp(argv[a],"-r")==0 && a+1<argc) g_rate = (unsigned)atoi(argv[++a]);
+        else if(strcmp(argv[a],"-s")==0 && a+1<argc) g_seg_ms = strtoul(argv[++a],0,10) * 1000UL;
+        else {
+            Job *j = &jobs[njobs++];
+            const char *dot = strrchr(argv[a], '.'), *slash = strrchr(argv[a], '/');
+            size_t stem = (dot && (!slash || dot > slash)) ? (size_t)(dot - argv[a]) : strlen(argv[a]);
+            if(stem > sizeof(j->out) - 5) stem = sizeof(j->out) - 5;
+            j->in = argv[a];
+            memcpy(j->out, argv[a], stem); strcpy(j->out + stem, ".wav");
+            pthread_mutex_init(&j->lock, 0);
+        }
+    }
+    if(njobs == 0){ printf("usage: m3batch [-j threads] [-r 11025|22050|44100] [-s segment_sec] files...\n"); return 2; }
+    if(g_nthreads < 1) g_nthreads = 1;
+    if(g_seg_ms == 0) g_seg_ms = 1000UL;
+    { Synth probe; synth_init(&probe, g_rate); g_rate = probe.rate; }   /* snap to a supported rate */
+
+    g_dq = (Deque*)calloc(g_nthreads, sizeof(Deque));
+    th = (pthread_t*)calloc(g_nthreads, sizeof(pthread_t));
+    if(!g_dq || !th) return 1;
+    for(i=0;i<g_nthreads;i++) pthread_mutex_init(&g_dq[i].m, 0);
+    for(i=0;i<njobs;i++) dq_push(i % g_nthreads, &jobs[i], -1);
+
+    t = mono_s();
+    for(i=0;i<g_nthreads;i++) pthread_create(&th[i], 0, worker, (void*)(size_t)i);
+    for(i=0;i<g_nthreads;i++) pthread_join(th[i], 0);
+    t = mono_s() - t;
+
+    {
+        unsigned ok = 0;
+        for(i=0;i<njobs;i++) if(jobs[i].ok) ok++;
+        printf("%u of %u files in %.3f s on %u thread(s), %lu steals\n", ok, njobs, t, g_nthreads, g_steals);
+        return ok == njobs ? 0 : 1;
+    }
+}
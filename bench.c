@@ -0,0 +1,261 @@
+/* Host benchmark for the music3 core.
+   Measures, with the same code the player uses:
+     - sheet parse throughput (compile_sheet on a generated multi-MB score)
+     - time to the first event when the same score is streamed instead
+     - cost of one oscilloscope frame (draw_play_frame, diffed present)
+     - software synth mixing cost per voice and sample
+     - MIDI bytes emitted per second of score (virtual clock)
+     - scheduled vs. actual dispatch time on a real-time clock (histogram)
+   Results go to bench_output.txt (or -o <file>) as JSON so runs can be
+   compared across commits.
+
+   Build/run: make bench
+*/
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "music3.h"
+
+const M3Io *g_io;
+
+static double mono_s(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+static unsigned long mono_us(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + (unsigned long)(ts.tv_nsec / 1000L);
+}
+
+/* ===== Counting backend: virtual clock, bytes are only counted ===== */
+static unsigned long g_vclock = 0;
+static unsigned long g_bytes = 0;
+
+static void nop(void){}
+static void nop_close(int row){ (void)row; }
+static int  yes(void){ return 1; }
+static int  no(void){ return 0; }
+static int  no_cap(const char *p){ (void)p; return 0; }
+static void count_write(unsigned char b){ (void)b; g_bytes++; }
+static unsigned long v_now(void){ return g_vclock; }
+static void v_wait(unsigned long ms){ if((long)(ms - g_vclock) > 0) g_vclock = ms; }
+static void cell_nop(unsigned idx, unsigned short cell){ (void)idx; (void)cell; }
+static int  no_key(int wait){ return wait ? '\r' : -1; }
+
+static const M3Io count_io = {
+    "bench-count",
+    nop, yes, count_write,
+    nop, nop, v_now, v_wait,
+    nop, cell_nop, nop_close,
+    no_key, no, nop, no_cap,
+    no, nop, no_cap
+};
+
+/* ===== Real-time backend: monotonic clock, sleeps until each deadline ===== */
+static unsigned long g_rt_base = 0;
+
+static void rt_start(void){ g_rt_base = mono_us(); }
+static unsigned long rt_now(void){ return (mono_us() - g_rt_base) / 1000UL; }
+static void rt_wait(unsigned long ms){
+    unsigned long target = g_rt_base + ms * 1000UL, now = mono_us();
+    if((long)(target - now) > 0){
+        struct timespec ts;
+        ts.tv_sec = (time_t)((target - now) / 1000000UL);
+        ts.tv_nsec = (long)((target - now) % 1000000UL) * 1000L;
+        nanosleep(&ts, 0);
+    }
+}
+
+static const M3Io rt_io = {
+    "bench-rt",
+    nop, yes, count_write,
+    rt_start, nop, rt_now, rt_wait,
+    nop, cell_nop, nop_close,
+    no_key, no, nop, no_cap,
+    no, nop, no_cap
+};
+
+/* ===== Score generator ===== */
+static unsigned long g_rng = 12345UL;
+static unsigned rnd(unsigned n){ g_rng = g_rng * 1103515245UL + 12345UL; return (unsigned)((g_rng >> 16) % n); }
+
+/* flats only: '#' starts a comment in the sheet format */
+static const char *NAMES[] = { "C","Db","D","Eb","E","F","Gb","G","Ab","A","Bb","B" };
+static const char DURS[] = "whqes";
+
+/* Writes about target bytes of sheet text; returns the number of notes in it.
+   dense: sixteenths only and no directives, for the timing run */
+static unsigned long gen_score(FILE *f, unsigned long target, int dense){
+    unsigned long bytes = 0, notes = 0, tok = 0;
+    while(bytes < target){
+        char buf[96]; int n;
+        unsigned r = rnd(100);
+        char d = dense ? 's' : DURS[1 + rnd(4)];
+        if(tok % 64 == 0 && !dense) n = sprintf(buf, "\n# bar %lu\nT=%u B=Q OVL=%u SUS=%s I=%u\n", tok/64, 60 + rnd(120), rnd(40), rnd(2) ? "ON" : "OFF", rnd(128));
+        else if(tok % 16 == 0) n = sprintf(buf, "\n");
+        else if(r < 60)      { n = sprintf(buf, "%s%u%c%s ", NAMES[rnd(12)], 2 + rnd(4), d, rnd(8) ? "" : "."); notes++; }
+        else if(r < 85)      { n = sprintf(buf, "[%s%u %s%u %s%u]%c ", NAMES[rnd(12)], 3 + rnd(2), NAMES[rnd(12)], 3 + rnd(2), NAMES[rnd(12)], 4, d); notes += 3; }
+        else if(r < 95)        n = sprintf(buf, "R%c ", d);
+        else                   n = sprintf(buf, "| ");
+        fputs(buf, f); bytes += (unsigned long)n; tok++;
+    }
+    fputc('\n', f);
+    return notes;
+}
+
+#define STREAM_TMP "m3bench.tmp"     /* streaming opens by path */
+#define NSYN 3
+static const unsigned SYN_NV[NSYN] = { 1, 4, 16 };
+
+/* ===== Jitter probe ===== */
+#define NBUCKET 10
+static const unsigned long BUCKET_US[NBUCKET] = { 50, 100, 250, 500, 1000, 2000, 5000, 10000, 50000, 0xFFFFFFFFUL };
+static unsigned long g_hist[NBUCKET];
+static unsigned long g_probe_n = 0, g_late_max = 0;
+static double g_late_sum = 0;
+
+static void probe(const Event *e, unsigned long now){
+    unsigned long actual = mono_us() - g_rt_base, sched = e->t * 1000UL, late;
+    int b;
+    (void)now;
+    late = actual > sched ? actual - sched : 0;
+    for(b=0; late > BUCKET_US[b]; b++) ;
+    g_hist[b]++; g_probe_n++; g_late_sum += (double)late;
+    if(late > g_late_max) g_late_max = late;
+}
+
+int main(int argc, char **argv){
+    const char *out_path = "bench_output.txt";
+    unsigned long parse_target = 4UL * 1024UL * 1024UL;
+    FILE *f, *out;
+    Score tl;
+    unsigned long notes, i, frames = 2000, events, ev_bytes;
+    double t, parse_s, first_s, frame_s, syn_ns[NSYN];
+    unsigned long song_ms = 0, song_bytes = 0, song_saved = 0, gen_ms, gen_bytes;
+    int a;
+
+    for(a=1;a<argc;a++){
+        if(strcmp(argv[a],"-o")==0 && a+1<argc) out_path = argv[++a];
+        else if(strcmp(argv[a],"-m")==0 && a+1<argc) parse_target = strtoul(argv[++a],0,10) * 1024UL * 1024UL;
+    }
+    g_io = &count_io;
+    scr_init();
+    midi_enc_reset();
+
+    /* --- parse throughput --- */
+    f = tmpfile();
+    if(!f){ perror("tmpfile"); return 1; }
+    notes = gen_score(f, parse_target, 0);
+    rewind(f);
+    t = mono_s();
+    compile_sheet(f, &tl);
+    parse_s = mono_s() - t;
+    fclose(f);
+    events = score_events(&tl); ev_bytes = score_bytes(&tl);
+    printf("parse: %lu bytes, %lu notes, %lu events in %.3f s (%.0f notes/s), %lu bytes of events (%.2f per event)%s\n",
+        parse_target, notes, events, parse_s, notes / parse_s, ev_bytes, events ? (double)ev_bytes / events : 0.0, score_truncated(&tl) ? " [event buffer full]" : "");
+
+    score_free(&tl);
+
+    /* --- streamed: only the first window is compiled before playback can start --- */
+    f = fopen(STREAM_TMP, "w");
+    if(!f){ perror(STREAM_TMP); return 1; }
+    g_rng = 12345UL;
+    gen_score(f, parse_target, 0);
+    fclose(f);
+    t = mono_s();
+    if(!sheet_stream_open(STREAM_TMP, &tl)){ perror(STREAM_TMP); return 1; }
+    first_s = mono_s() - t;
+    score_free(&tl);
+    remove(STREAM_TMP);
+    printf("stream: first event ready after %.3f ms (whole-file compile: %.3f ms)\n", first_s * 1e3, parse_s * 1e3);
+
+    /* --- MIDI bandwidth on a generated score (64 KB: the player also draws
+           a frame every 30 ms of score time, even on the virtual clock) --- */
+    f = tmpfile();
+    if(!f){ perror("tmpfile"); return 1; }
+    gen_score(f, 64UL * 1024UL, 0);
+    rewind(f);
+    compile_sheet(f, &tl);
+    fclose(f);
+    g_bytes = 0; g_vclock = 0;
+    play_timeline(&tl);
+    gen_ms = tl.len; gen_bytes = g_bytes;
+    score_free(&tl);
+
+    /* --- MIDI bandwidth on song.txt, if present --- */
+    if(load_score("song.txt", &tl)){
+        unsigned long saved0 = g_enc_saved;
+        midi_enc_reset();
+        g_bytes = 0; g_vclock = 0;
+        play_timeline(&tl);
+        song_ms = tl.len; song_bytes = g_bytes; song_saved = g_enc_saved - saved0;
+        score_free(&tl);
+    }
+
+    /* --- frame cost: a changing chord so every present has real diffs --- */
+    {
+        unsigned char notes[8];
+        for(i=0;i<8;i++) notes[i] = (unsigned char)(48 + i*5);
+        t = mono_s();
+        for(i=0;i<frames;i++) draw_play_frame(notes, 1 + (int)(i % 8));
+        frame_s = (mono_s() - t) / (double)frames;
+    }
+    printf("frame: %.2f us per frame\n", frame_s * 1e6);
+
+    /* --- synth: held organ notes (no decay), so every voice mixes every sample --- */
+    for(a=0;a<NSYN;a++){
+        static short pcm[1024];
+        Synth syn; unsigned k; unsigned long rendered = 0;
+        synth_init(&syn, 22050U);
+        synth_midi(&syn, 0xC0); synth_midi(&syn, 16);
+        for(k=0;k<SYN_NV[a];k++){ synth_midi(&syn, 0x90); synth_midi(&syn, (unsigned char)(36 + k*5)); synth_midi(&syn, 100); }
+        t = mono_s();
+        while(rendered < 22050UL * 10UL){ synth_render(&syn, pcm, 1024); rendered += 1024; }
+        syn_ns[a] = (mono_s() - t) * 1e9 / ((double)rendered * SYN_NV[a]);
+        printf("synth: %u voices, %.2f ns per voice-sample\n", SYN_NV[a], syn_ns[a]);
+    }
+
+    /* --- jitter: a few seconds of dense sixteenths on the real-time clock --- */
+    f = tmpfile();
+    if(!f){ perror("tmpfile"); return 1; }
+    fputs("T=480 OVL=0\n", f);
+    gen_score(f, 1200, 1);
+    rewind(f);
+    compile_sheet(f, &tl);
+    fclose(f);
+    g_io = &rt_io;
+    g_dispatch_hook = probe;
+    g_io->clock_start();
+    play_timeline(&tl);
+    g_dispatch_hook = 0;
+    score_free(&tl);
+    printf("jitter: %lu events, mean %.0f us, max %lu us\n", g_probe_n, g_probe_n ? g_late_sum / g_probe_n : 0.0, g_late_max);
+
+    out = fopen(out_path, "w");
+    if(!out){ perror(out_path); return 1; }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"parse\": {\"bytes\": %lu, \"notes\": %lu, \"seconds\": %.6f, \"notes_per_sec\": %.0f, \"events\": %lu, \"event_bytes\": %lu},\n",
+        parse_target, notes, parse_s, notes / parse_s, events, ev_bytes);
+    fprintf(out, "  \"stream\": {\"first_event_ms\": %.3f},\n", first_s * 1e3);
+    fprintf(out, "  \"frame\": {\"frames\": %lu, \"us_per_frame\": %.3f},\n", frames, frame_s * 1e6);
+    fprintf(out, "  \"synth\": {\"rate\": 22050, \"ns_per_voice_sample\": [");
+    for(a=0;a<NSYN;a++) fprintf(out, "%s{\"voices\": %u, \"ns\": %.3f}", a ? ", " : "", SYN_NV[a], syn_ns[a]);
+    fprintf(out, "]},\n");
+    fprintf(out, "  \"midi\": {\"generated_ms\": %lu, \"generated_bytes\": %lu, \"generated_bytes_per_sec\": %.1f,\n",
+        gen_ms, gen_bytes, gen_ms ? gen_bytes * 1000.0 / gen_ms : 0.0);
+    fprintf(out, "           \"song_ms\": %lu, \"song_bytes\": %lu, \"song_bytes_per_sec\": %.1f, \"song_encoder_saved\": %lu},\n",
+        song_ms, song_bytes, song_ms ? song_bytes * 1000.0 / song_ms : 0.0, song_saved);
+    fprintf(out, "  \"jitter\": {\"events\": %lu, \"mean_us\": %.1f, \"max_us\": %lu, \"hist\": [",
+        g_probe_n, g_probe_n ? g_late_sum / g_probe_n : 0.0, g_late_max);
+    for(a=0;a<NBUCKET;a++){
+        if(a+1 < NBUCKET) fprintf(out, "%s{\"le_us\": %lu, \"n\": %lu}", a ? ", " : "", BUCKET_US[a], g_hist[a]);
+        else              fprintf(out, ", {\"le_us\": null, \"n\": %lu}", g_hist[a]);
+    }
+    fprintf(out, "]}\n}\n");
+    fclose(out);
+    printf("wrote %s\n", out_path);
+    return 0;
+}
@@ -0,0 +1,166 @@
+/* DOS / DOSBox backend (OpenWatcom 16-bit): MPU-401 UART ports, PIT clock
+   on INT 8 (which also polls the MPU input), text VRAM, INT 9 keyboard.
+*/
+#include <dos.h>     /* delay, int86, _dos_getvect, _dos_setvect, _chain_intr, MK_FP */
+#include <i86.h>     /* _disable, _enable, int86 */
+#include <conio.h>   /* inp, outp, kbhit, getch */
+#include "music3.h"
+
+/* ===== Low-level port helpers ===== */
+#if defined(__WATCOMC__)
+  #define inb(p)    inp((unsigned)(p))
+  #define outb(p,v) outp((unsigned)(p), (int)(v))
+#else
+  #define inb(p)    inportb((unsigned)(p))
+  #define outb(p,v) outportb((unsigned)(p), (unsigned char)(v))
+#endif
+
+/* BIOS cursor move (INT 10h, AH=02h) — 1-based x,y */
+static void bios_gotoxy(int x, int y){
+    union REGS r;
+    if (x < 1) x = 1;
+    if (y < 1) y = 1;
+    r.h.ah = 0x02; r.h.bh = 0x00;
+    r.h.dh = (unsigned char)(y - 1);
+    r.h.dl = (unsigned char)(x - 1);
+    int86(0x10, &r, &r);
+}
+/* BIOS cursor shape (INT 10h, AH=01h): 0x2000 hides it */
+static void bios_cursor_shape(unsigned shape){
+    union REGS r;
+    r.h.ah = 0x01; r.w.cx = shape;
+    int86(0x10, &r, &r);
+}
+
+/* ===== Text VRAM ===== */
+static unsigned short __far *g_vram;
+
+static void dos_scr_open(void){
+    union REGS r;
+    r.h.ah = 0x0F; int86(0x10, &r, &r);      /* mode 7 = MDA/Hercules text at B000 */
+    g_vram = (unsigned short __far *)MK_FP(r.h.al == 7 ? 0xB000 : 0xB800, 0);
+    bios_cursor_shape(0x2000);
+}
+static void dos_scr_cell(unsigned idx, unsigned short cell){ g_vram[idx] = cell; }
+static void dos_scr_close(int row){ bios_cursor_shape(0x0607); bios_gotoxy(1, row); }
+
+/* ===== MIDI via MPU-401 UART (DOSBox: mpu401=uart, mididevice=default) ===== */
+#define MPU_DATA 0x330
+#define MPU_CMD  0x331
+#define MPU_STAT 0x331
+
+static int  mpu_ready(void){ return (inb(MPU_STAT)&0x40)==0; }
+static void mpu_data(unsigned char b){ outb(MPU_DATA,b); }
+static void mpu_cmd(unsigned char c){ unsigned long t=65535UL; while(t--) if((inb(MPU_STAT)&0x40)==0){ outb(MPU_CMD,c); return; } }
+static void mpu_init_uart(void){ mpu_cmd(0xFF); delay(10); mpu_cmd(0x3F); delay(10); }
+
+/* ===== High-resolution clock: PIT channel 0 reprogrammed to ~1 kHz on INT 8 ===== */
+#define PIT_CTRL   0x43
+#define PIT_CH0    0x40
+#define PIT_HZ1000 1193182UL             /* PIT input clock in mHz per ms (1.193182 MHz) */
+#define PIT_DIV    1193U                 /* 1193182 / 1193 = ~1000.15 interrupts per second */
+
+static volatile unsigned long g_ms = 0;  /* absolute ms since timer_install */
+static unsigned long g_ms_frac = 0;      /* PIT counts*1000 not yet turned into a ms */
+static unsigned g_bios_acc = 0;          /* PIT counts since the last BIOS (18.2 Hz) tick */
+static void (__interrupt __far *old_int8)(void) = 0;
+static int g_timer_on = 0;
+
+/* ===== MIDI input: polled from the tick ===== */
+/* Bit 7 of the MPU status is clear while a byte waits. The MPU IRQ line
+   differs from card to card, so the 1 kHz tick polls instead: at 3125
+   bytes a second a few per tick keep up. The ACKs left over from the reset
+   arrive as 0xFE, which the parser drops like active sensing. */
+#define MPU_IN_PER_TICK 8
+static volatile unsigned char g_mpu_in = 0;
+
+static void mpu_in_poll(void){
+    int n;
+    for(n = 0; n < MPU_IN_PER_TICK && (inb(MPU_STAT)&0x80) == 0; n++) midi_in_push(inb(MPU_DATA), g_ms);
+}
+static int  mpu_in_install(void){ g_mpu_in = 1; return 1; }
+static void mpu_in_remove(void){ g_mpu_in = 0; }
+static int  mpu_in_file(const char *path){ (void)path; return 0; }
+
+void __interrupt __far timer_isr(void){
+    /* exact long-term rate: credit the real PIT period, not a rounded 1 ms */
+    g_ms_frac += (unsigned long)PIT_DIV * 1000UL;
+    if(g_ms_frac >= PIT_HZ1000){ g_ms_frac -= PIT_HZ1000; g_ms++; }
+    g_tm[TM_TIMER_ISR]++;
+    if(g_tx_async) mpu_pump();
+    if(g_mpu_in) mpu_in_poll();
+    /* every 65536 PIT counts the BIOS handler gets its tick (and sends the EOI) */
+    g_bios_acc += PIT_DIV;
+    if(g_bios_acc < PIT_DIV){ _chain_intr(old_int8); }
+    outb(0x20,0x20);
+}
+
+static void timer_install(void){
+    if(g_timer_on) return;
+    _disable();
+    old_int8 = _dos_getvect(8); _dos_setvect(8, timer_isr);
+    outb(PIT_CTRL, 0x36);                 /* ch0, lo/hi, mode 3 */
+    outb(PIT_CH0, PIT_DIV & 0xFF); outb(PIT_CH0, PIT_DIV >> 8);
+    g_timer_on = 1; g_tx_async = 1;
+    _enable();
+}
+static void timer_remove(void){
+    if(!g_timer_on) return;
+    mpu_flush(TX_STALL_MS);
+    _disable();
+    g_tx_async = 0;
+    outb(PIT_CTRL, 0x36); outb(PIT_CH0, 0); outb(PIT_CH0, 0);   /* back to 18.2 Hz */
+    _dos_setvect(8, old_int8);
+    g_timer_on = 0;
+    _enable();
+    mpu_drain_polled();
+}
+/* 32-bit read is two words on a 286: keep the ISR out while copying */
+static unsigned long timer_now(void){ unsigned long t; _disable(); t = g_ms; _enable(); return t; }
+static void timer_wait_until(unsigned long t){ while((long)(timer_now() - t) < 0) ; }
+
+/* ===== Keyboard ===== */
+static int dos_key(int wait){
+    if(!wait && !kbhit()) return -1;
+    return getch();
+}
+
+/* ===== Interactive mode: INT 9 ISR ===== */
+static void (__interrupt __far *old_int9)(void) = 0;
+
+void __interrupt __far kb_isr(void){
+    unsigned char sc   = inb(0x60);
+    unsigned char make = (sc & 0x80) ? 0 : 1;
+    unsigned char code = sc & 0x7F;
+    g_tm[TM_KEY_ISR]++;
+
+    if(code==0x01){ esc_down   = make ? 1 : 0; }      /* ESC */
+    else if(code==0x39){ space_down = make ? 1 : 0; } /* Space */
+    else if(key_of_sc[code] >= 0) key_push(key_of_sc[code], make, g_ms);   /* INT 8 cannot run in here */
+    /* ACK keyboard + EOI */
+    { unsigned char v = inb(0x61); outb(0x61,(unsigned char)(v|0x80)); outb(0x61,(unsigned char)(v&0x7F)); }
+    outb(0x20,0x20);
+}
+
+static int dos_kbd_install(void){
+    _disable(); old_int9 = _dos_getvect(9); _dos_setvect(9, kb_isr); _enable();
+    return 1;
+}
+static void dos_kbd_remove(void){
+    _disable(); _dos_setvect(9, old_int9); _enable();
+}
+
+static int dos_capture(const char *path){ (void)path; return 0; }
+
+static const M3Io dos_io = {
+    "dos",
+    mpu_init_uart, mpu_ready, mpu_data,
+    timer_install, timer_remove, timer_now, timer_wait_until,
+    dos_scr_open, dos_scr_cell, dos_scr_close,
+    dos_key,
+    dos_kbd_install, dos_kbd_remove,
+    dos_capture,
+    mpu_in_install, mpu_in_remove, mpu_in_file
+};
+
+const M3Io *m3_default_io(void){ return &dos_io; }
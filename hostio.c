@@ -0,0 +1,94 @@
+/* Native host backend: runs the playback engine at full speed on a virtual
+   clock and captures every MIDI byte with its timestamp.
+   Capture format, one byte per line: "<ms> <hex byte>". MIDI input can be
+   replayed from a file in the same format (-i): each byte arrives when the
+   clock passes its time, and Esc is pressed a second after the last one.
+*/
+#include <stdio.h>
+#include <string.h>  /* memset */
+#include "music3.h"
+
+/* ===== Virtual clock: waiting just moves time forward ===== */
+static unsigned long g_vclock = 0;
+
+static void host_clock_start(void){}
+static void host_clock_stop(void){}
+static unsigned long host_now(void){ return g_vclock; }
+static void host_in_feed(void);
+static void host_wait_until(unsigned long ms){ if((long)(ms - g_vclock) > 0) g_vclock = ms; host_in_feed(); }
+
+/* ===== MIDI capture ===== */
+static FILE *g_cap = 0;
+
+static void host_midi_reset(void){}
+static int  host_midi_ready(void){ return 1; }
+static void host_midi_write(unsigned char b){
+    if(!g_cap) g_cap = stdout;
+    fprintf(g_cap, "%lu %02X\n", g_vclock, (unsigned)b);
+}
+static int host_capture(const char *path){
+    FILE *f = fopen(path, "w");
+    if(!f) return 0;
+    g_cap = f;
+    return 1;
+}
+
+/* ===== Screen: kept in memory, the last frame goes to stderr on close ===== */
+static unsigned short g_cells[SCR_W*SCR_H];
+
+static void host_scr_open(void){ memset(g_cells, 0, sizeof(g_cells)); }
+static void host_scr_cell(unsigned idx, unsigned short cell){ if(idx < SCR_W*SCR_H) g_cells[idx] = cell; }
+static void host_scr_close(int row){
+    int y, x, end;
+    (void)row;
+    for(y=0;y<SCR_H;y++){
+        char line[SCR_W+1];
+        for(end=0, x=0;x<SCR_W;x++){
+            char c = (char)(g_cells[y*SCR_W+x] & 0xFF);
+            line[x] = c ? c : ' ';
+            if(line[x] != ' ') end = x+1;
+        }
+        line[end] = 0;
+        if(end) fprintf(stderr, "%s\n", line);
+    }
+    if(g_cap && g_cap != stdout){ fclose(g_cap); g_cap = 0; }
+}
+
+/* ===== Keyboard: nobody is there, any prompt is answered at once ===== */
+static int  host_key(int wait){ return wait ? '\r' : -1; }
+static int  host_kbd_install(void){ return 0; }
+static void host_kbd_remove(void){}
+
+/* ===== MIDI input: replayed from a capture file ===== */
+#define IN_DONE_MS 1000
+static FILE *g_in = 0;
+static unsigned long g_in_t, g_in_end;      /* the byte read ahead; time of the last one */
+static unsigned g_in_b;
+static unsigned char g_in_on = 0, g_in_more = 0;
+
+static void host_in_next(void){ g_in_more = g_in && fscanf(g_in, "%lu %x", &g_in_t, &g_in_b) == 2; }
+static void host_in_feed(void){
+    if(!g_in_on) return;
+    for(; g_in_more && (long)(g_in_t - g_vclock) <= 0; host_in_next()){ midi_in_push((unsigned char)g_in_b, g_in_t); g_in_end = g_in_t; }
+    if(!g_in_more && (long)(g_vclock - g_in_end) >= IN_DONE_MS) esc_down = 1;
+}
+static int host_in_file(const char *path){
+    if((g_in = fopen(path, "r")) == 0) return 0;
+    host_in_next();
+    return 1;
+}
+static int  host_in_install(void){ if(!g_in) return 0; g_in_end = g_vclock; g_in_on = 1; return 1; }
+static void host_in_remove(void){ g_in_on = 0; if(g_in){ fclose(g_in); g_in = 0; } }
+
+static const M3Io host_io = {
+    "host",
+    host_midi_reset, host_midi_ready, host_midi_write,
+    host_clock_start, host_clock_stop, host_now, host_wait_until,
+    host_scr_open, host_scr_cell, host_scr_close,
+    host_key,
+    host_kbd_install, host_kbd_remove,
+    host_capture,
+    host_in_install, host_in_remove, host_in_file
+};
+
+const M3Io *m3_default_io(void){ return &host_io; }
@@ -0,0 +1,202 @@
+/* MIDI output: transmit queue drained by the backend's timer tick, and the
+   wire encoder (running status, note-off as velocity 0, no-op suppression).
+   All port access goes through g_io.
+*/
+#include <string.h>  /* memset, memcpy */
+#include "music3.h"
+
+/* Bounded busy-wait on the port, used only when no tick drains the queue */
+static int mpu_wait_tx_ready(void){
+    unsigned long t=65535UL;
+    while(t--) if(g_io->midi_ready()){ g_tm[TM_MPU_SPINS] += 65534UL - t; return 1; }
+    g_tm[TM_MPU_SPINS] += 65535UL; g_tm[TM_MPU_TIMEOUTS]++;
+    return 0;
+}
+
+/* Transmit queue: the main loop only ever appends, the timer tick sends
+   whatever the UART will take. Single producer / single consumer with
+   byte-sized indices, so neither side needs to mask interrupts. Messages
+   go in whole or not at all, so the head is always on a message boundary. */
+#define TXQ_SIZE      256                /* index wraps as an unsigned char */
+static unsigned char g_txq[TXQ_SIZE];
+static volatile unsigned char g_txq_head = 0;   /* producer (main loop) */
+static volatile unsigned char g_txq_tail = 0;   /* consumer (timer tick) */
+volatile unsigned char g_tx_async = 0;          /* 1 while the timer tick drains the queue */
+static unsigned g_tx_stall = 0;                 /* consecutive ticks the UART stayed busy */
+static volatile unsigned char g_tx_resync = 0;  /* bytes were lost: send no data byte before a status */
+unsigned g_tx_overflow = 0;                     /* bytes refused because the queue was full */
+volatile unsigned g_tx_dropped = 0;             /* queued bytes discarded after a stall */
+
+/* After a loss the receiver may hold half a message, and a message queued
+   under running status would be read against it: skip data bytes (whole
+   messages) up to the next status byte, which cancels the partial one */
+static unsigned char tx_resync(unsigned char tail){
+    if(!g_tx_resync) return tail;
+    while(tail != g_txq_head && g_txq[tail] < 0x80){ tail++; g_tx_dropped++; }
+    if(tail != g_txq_head) g_tx_resync = 0;
+    return tail;
+}
+
+/* Send queued bytes while the UART is ready; never waits. Called from the tick. */
+void mpu_pump(void){
+    unsigned char tail = g_txq_tail;
+    if(tail == g_txq_head){ g_tx_stall = 0; return; }
+    while((tail = tx_resync(tail)) != g_txq_head && g_io->midi_ready()){ g_io->midi_write(g_txq[tail]); tail++; g_tx_stall = 0; }
+    if(tail != g_txq_head) g_tm[TM_TX_BUSY]++;
+    if(tail != g_txq_head && ++g_tx_stall >= TX_STALL_MS){
+        /* the rest of the queue is whole messages, bar the one being sent */
+        g_tm[TM_TX_STALLS]++;
+        g_tx_dropped += (unsigned char)(g_txq_head - tail);
+        tail = g_txq_head; g_tx_stall = 0; g_tx_resync = 1;
+    }
+    g_txq_tail = tail;
+}
+
+/* Without the tick (startup/shutdown, host build) drain the old way: busy-wait per byte */
+void mpu_drain_polled(void){
+    while((g_txq_tail = tx_resync(g_txq_tail)) != g_txq_head){
+        if(mpu_wait_tx_ready()) g_io->midi_write(g_txq[g_txq_tail]); else { g_tx_dropped++; g_tx_resync = 1; }
+        g_txq_tail++;
+    }
+}
+
+/* all n bytes or none, leaving reserve bytes free; returns 0 if the message was refused */
+static int mpu_write_msg(const unsigned char *m, unsigned n, unsigned reserve){
+    unsigned char head = g_txq_head;
+    unsigned i;
+    if((unsigned char)(g_txq_tail - head - 1) < n + reserve){ g_tx_overflow += n; return 0; }
+    for(i=0;i<n;i++) g_txq[(unsigned char)(head + i)] = m[i];
+    g_txq_head = (unsigned char)(head + n);             /* publish after the bytes are written */
+    if(!g_tx_async) mpu_drain_polled();
+    return 1;
+}
+
+/* Give the tick up to ms to empty the transmit queue */
+void mpu_flush(unsigned ms){
+    unsigned long until = g_io->now() + ms;
+    while(g_txq_tail != g_txq_head && (long)(g_io->now() - until) < 0) ;
+}
+
+/* ===== MIDI wire encoder: running status, note-off as velocity 0, no-op suppression ===== */
+#define CC_UNKNOWN 0xFF                  /* data bytes are 7-bit, so this never matches */
+static unsigned char g_run_status = 0;   /* status byte the receiver is holding, 0 = none */
+static unsigned char g_noteoff_v0 = 1;   /* send note-off as note-on velocity 0 */
+static unsigned char g_cc_state[16][128];
+static unsigned char g_prog_state[16];
+static unsigned g_enc_seen_drops = 0;    /* g_tx_dropped and g_tx_overflow the state was checked against */
+static unsigned g_enc_seen_ovf = 0;
+unsigned long g_enc_saved = 0;           /* bytes the encoder did not have to send */
+
+/* A note-off is never lost for good, or the note would hang until the end
+   of the piece. Note-offs may use the last TX_RESERVE bytes of the queue,
+   which nothing else can; one that still does not fit is owed, and goes out
+   ahead of the next message that does. A stall drops queued bytes without
+   saying which: every note struck since the queue was last seen empty and
+   not sounding now may have lost its note-off there, so those are owed
+   too. Bit per note. */
+#define TX_RESERVE 48
+static unsigned char g_note_on[16][16];      /* note-on queued, its note-off not yet */
+static unsigned char g_note_struck[16][16];  /* note-on queued since the queue was empty */
+static unsigned char g_note_owed[16][16];    /* note-off to send again */
+static unsigned char g_owed_any = 0;
+static unsigned g_struck_dirty = 0;          /* bit per channel: a struck note went off since */
+static unsigned g_note_seen_drops = 0;
+
+static void enc_forget(void){
+    g_run_status = 0;
+    memset(g_cc_state, CC_UNKNOWN, sizeof(g_cc_state));
+    memset(g_prog_state, CC_UNKNOWN, sizeof(g_prog_state));
+}
+
+/* Forget everything we assumed about the receiver (after a reset) */
+void midi_enc_reset(void){
+    enc_forget();
+    memset(g_note_on, 0, sizeof(g_note_on));
+    memset(g_note_struck, 0, sizeof(g_note_struck));
+    memset(g_note_owed, 0, sizeof(g_note_owed));
+    g_owed_any = 0; g_struck_dirty = 0; g_note_seen_drops = g_tx_dropped;
+}
+
+/* A lost message may have been a status, a pedal-up, a program change or
+   a note-off: assume nothing about the receiver after one */
+static void midi_enc_check(void){
+    unsigned char *on = &g_note_on[0][0], *struck = &g_note_struck[0][0], *owed = &g_note_owed[0][0];
+    unsigned i;
+    if(g_enc_seen_drops == g_tx_dropped && g_enc_seen_ovf == g_tx_overflow) return;
+    g_enc_seen_drops = g_tx_dropped; g_enc_seen_ovf = g_tx_overflow;
+    enc_forget();
+    if(g_note_seen_drops == g_tx_dropped) return;
+    g_note_seen_drops = g_tx_dropped;
+    for(i=0;i<sizeof(g_note_owed);i++){
+        unsigned char lost = (unsigned char)(struck[i] & ~on[i]);
+        if(lost){ owed[i] |= lost; g_owed_any = 1; }
+        struck[i] = on[i];
+    }
+}
+
+/* One channel message, status left out when the receiver already holds it */
+static int midi_put(unsigned char st, unsigned char d1, unsigned char d2, unsigned nd){
+    unsigned char m[3], ch = (unsigned char)(st & 0x0F), bit = (unsigned char)(1U << (d1 & 7));
+    unsigned n = 0, off = (st & 0xF0) == 0x80 || ((st & 0xF0) == 0x90 && d2 == 0), empty = g_txq_tail == g_txq_head;
+    midi_enc_check();
+    if(empty && g_struck_dirty){             /* all sent: only what sounds can lose its off now */
+        unsigned c;
+        for(c=0;c<16;c++) if(g_struck_dirty & (1U << c)) memcpy(g_note_struck[c], g_note_on[c], sizeof(g_note_on[c]));
+        g_struck_dirty = 0;
+    }
+    if(st != g_run_status) m[n++] = st;
+    m[n++] = d1;
+    if(nd == 2) m[n++] = d2;
+    if(!mpu_write_msg(m, n, off ? 0 : TX_RESERVE)) return 0;   /* refused whole: the receiver saw none of it */
+    if(st == g_run_status) g_enc_saved++;
+    g_run_status = st;
+    if(off){ g_note_on[ch][d1 >> 3] &= (unsigned char)~bit; g_note_owed[ch][d1 >> 3] &= (unsigned char)~bit; g_struck_dirty |= 1U << ch; }
+    else if((st & 0xF0) == 0x90){ g_note_on[ch][d1 >> 3] |= bit; g_note_struck[ch][d1 >> 3] |= bit; }
+    return 1;
+}
+
+static int note_off_msg(unsigned ch, unsigned note, unsigned vel){
+    if(g_noteoff_v0) return midi_put((unsigned char)(0x90 | ch), (unsigned char)note, 0, 2);
+    return midi_put((unsigned char)(0x80 | ch), (unsigned char)note, (unsigned char)vel, 2);
+}
+
+/* owed note-offs first, in note order, while they fit */
+static void pay_owed(void){
+    unsigned ch, note;
+    midi_enc_check();
+    for(ch=0;ch<16;ch++) for(note=0;note<128;note++)
+        if((g_note_owed[ch][note >> 3] & (1U << (note & 7))) && !note_off_msg(ch, note, 64)) return;
+    g_owed_any = 0;
+}
+
+static int midi_msg(unsigned char st, unsigned char d1, unsigned char d2, unsigned nd){
+    if(g_owed_any) pay_owed();
+    return midi_put(st, d1, d2, nd);
+}
+
+void midi_note_on (unsigned ch, unsigned note, unsigned vel){
+    midi_msg((unsigned char)(0x90 | (ch&0x0F)), (unsigned char)(note&0x7F), (unsigned char)(vel&0x7F), 2);
+}
+void midi_note_off(unsigned ch, unsigned note, unsigned vel){
+    ch &= 0x0F; note &= 0x7F;
+    if(g_owed_any) pay_owed();
+    if(note_off_msg(ch, note, vel & 0x7F)) return;
+    g_note_on[ch][note >> 3] &= (unsigned char)~(1U << (note & 7));
+    g_note_owed[ch][note >> 3] |= (unsigned char)(1U << (note & 7));
+    g_owed_any = 1;
+}
+/* the cached state only changes once the message is in the queue */
+void midi_prog_change(unsigned ch,unsigned prog){
+    ch &= 0x0F; prog &= 0x7F;
+    midi_enc_check();
+    if(g_prog_state[ch] == prog){ g_enc_saved += 2; return; }
+    if(midi_msg((unsigned char)(0xC0 | ch), (unsigned char)prog, 0, 1)) g_prog_state[ch] = (unsigned char)prog;
+}
+void midi_cc(unsigned ch, unsigned cc, unsigned val){
+    ch &= 0x0F; cc &= 0x7F; val &= 0x7F;
+    midi_enc_check();
+    /* channel mode messages (120..127) are commands, never "already set" */
+    if(cc < 120 && g_cc_state[ch][cc] == val){ g_enc_saved += 3; return; }
+    if(midi_msg((unsigned char)(0xB0 | ch), (unsigned char)cc, (unsigned char)val, 2) && cc < 120) g_cc_state[ch][cc] = (unsigned char)val;
+}
+void midi_all_notes_off(unsigned ch){ midi_cc(ch, 123, 0); }
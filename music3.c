@@ -1,450 +1,331 @@
-/* Music3 for DOS / DOSBox (OpenWatcom 16-bit)
-   - Interactive poly keyboard when no args
-   - Sheet playback with ASCII oscilloscope (single averaged trace) when file given
+/* Music3 for DOS / DOSBox (OpenWatcom 16-bit), with a native host build
+   - Interactive poly keyboard when no args; keys are queued with timestamps by
+     the INT 9 ISR and sent at once, with a key-to-MIDI latency readout
+   - MIDI input: INT 8 polls the MPU-401 and queues each byte with its time;
+     the loop merges it with the keys, passes notes, controllers and programs
+     through and shows the notes on the scope
+   - music3 -R take.txt|take.mid [-q 16] records the live take into a buffer
+     allocated before it starts; on Esc the notes are paired, quantized (-q:
+     notes per whole, 0 = off) and written as a sheet or a .mid
+   - Sheet playback with ASCII oscilloscope (every sounding note summed) when file given
+   - Sheets are compiled to timestamped events a window ahead of playback,
+     read in blocks so lines can be any length and memory stays flat
+   - Times are exact ticks (960 a quarter); T= and B= start tempo map segments
+     per voice, and ticks turn into ms only as the events are played, so long
+     pieces do not drift
+   - Compiled events are packed (delta-time varints, a byte per note, about
+     3 bytes an event) into arenas on the far heap, outside the 64 KB data
+     segment, so the DOS build holds scores of tens of thousands of events
+   - Screen frames are diffed off-screen and written straight to text VRAM;
+     a frame is only drawn when the notes or status changed, and waits while
+     an event is about to fall due
+   - music3 song.txt -o song.mid converts offline to a Standard MIDI File
+     (type 1, a track per voice, when the sheet has several), with its ticks
+     and tempo changes when all voices share them;
+     music3 song.mid plays a type 0/1 SMF through the same MPU-401 path
+   - Events are scheduled against a ~1 kHz PIT clock (INT 8, chained to the BIOS)
+   - MIDI bytes go through a transmit queue that the timer tick drains
+   - Encoder uses running status and skips controller/program no-ops
+   - music3 song.txt -w song.wav renders through the built-in synth (wavetable
+     voices, ADSR that follows SUS=, fixed-point mixer) instead of the MPU-401
+   - Telemetry: event lateness, frame time, MPU waits/stalls/drops and ISR
+     counts are always counted; -t (or T while playing) shows them on the
+     bottom row, -l file.log writes them with the last events on exit
+     (m3tlog summarizes the log on the host)
    - Beat units: B=Q|E|H|W|S|DQ (dotted-quarter)
    - Tempo: T=### (beats per chosen unit)
    - Instrument: I=###
    - Sustain pedal: SUS=ON|OFF (CC64)
-   - Grace overlap: OVL=ms (default 20ms) to slightly overlap consecutive notes/chords
-
-   Build: wcl -bt=dos -ms -l=dos -fe:music3.exe music3.c
+   - Grace overlap: OVL=ms (default 20ms): each note-off lands that long into the
+     next note, which still starts on time; under SUS=ON the pedal is changed
+     that long after each new note instead
+   - Voices: V=n (0..7) switches to a voice with its own clock, channel, I=, SUS=
+     and OVL=; voices are merged by timestamp at play time. CH=n sets its channel
+   - Repeats: |: ... :| xN (twice without xN); patterns: P=name { ... } defines,
+     @name[+n|-n] [xN] plays it transposed on the voice's channel. Both are
+     stored once and unrolled by the cursor as they play
+
+   Hardware sits behind the M3Io backend (music3.h): dosio.c for DOS,
+   hostio.c for the native build, which runs on a virtual clock and writes
+   the timestamped MIDI byte stream to stdout or to -c <file>, and replays
+   MIDI input from a file in the same format with -i <file>.
+
+   Build (DOS):  wcl -bt=dos -ms -l=dos -fe=music3.exe music3.c sheet.c score.c smf.c midiout.c screen.c player.c synth.c telem.c record.c dosio.c
+   Build (host): make
 */
 
-#include <dos.h>     /* delay, int86, _dos_getvect, _dos_setvect */
-#include <i86.h>     /* _disable, _enable, int86 */
-#include <conio.h>   /* putch, cputs, kbhit, getch */
-#include <stdio.h>   /* FILE, fopen, fgets, sprintf */
-#include <string.h>  /* memset, strchr, strcmp */
-#include <ctype.h>   /* isspace, isdigit, tolower, toupper */
-
-/* ===== Low-level port helpers ===== */
-#if defined(__WATCOMC__)
-  #define inb(p)    inp((unsigned)(p))
-  #define outb(p,v) outp((unsigned)(p), (int)(v))
-#else
-  #define inb(p)    inportb((unsigned)(p))
-  #define outb(p,v) outportb((unsigned)(p), (unsigned char)(v))
-#endif
-
-/* BIOS cursor move (INT 10h, AH=02h) — 1-based x,y */
-#ifdef gotoxy
-#undef gotoxy
-#endif
-static void bios_gotoxy(int x, int y){
-    union REGS r;
-    if (x < 1) x = 1; if (y < 1) y = 1;
-    r.h.ah = 0x02; r.h.bh = 0x00;
-    r.h.dh = (unsigned char)(y - 1);
-    r.h.dl = (unsigned char)(x - 1);
-    int86(0x10, &r, &r);
-}
-#define gotoxy(x,y)  bios_gotoxy((x),(y))
-#define cputch(ch)   putch((int)(ch))
-
-/* Clear 80x24 area */
-static void cls_area(void){
-    int r, c;
-    for (r = 1; r <= 24; ++r) { gotoxy(1, r); for (c = 0; c < 80; ++c) cputch(' '); }
-}
-
-/* ===== MIDI via MPU-401 UART (DOSBox: mpu401=uart, mididevice=default) ===== */
-#define MPU_DATA 0x330
-#define MPU_CMD  0x331
-#define MPU_STAT 0x331
-
-static int  mpu_wait_tx_ready(void){ unsigned long t=65535UL; while(t--) if((inb(MPU_STAT)&0x40)==0) return 1; return 0; }
-static void mpu_write_byte(unsigned char b){ if(mpu_wait_tx_ready()) outb(MPU_DATA,b); }
-static void mpu_cmd(unsigned char c){ unsigned long t=65535UL; while(t--) if((inb(MPU_STAT)&0x40)==0){ outb(MPU_CMD,c); return; } }
-static void mpu_init_uart(void){ mpu_cmd(0xFF); delay(10); mpu_cmd(0x3F); delay(10); }
-
-static void midi_note_on (unsigned ch, unsigned note, unsigned vel){
-    mpu_write_byte(0x90 | (ch&0x0F)); mpu_write_byte(note&0x7F); mpu_write_byte(vel&0x7F);
-}
-static void midi_note_off(unsigned ch, unsigned note, unsigned vel){
-    mpu_write_byte(0x80 | (ch&0x0F)); mpu_write_byte(note&0x7F); mpu_write_byte(vel&0x7F);
-}
-static void midi_prog_change(unsigned ch,unsigned prog){
-    mpu_write_byte(0xC0 | (ch&0x0F)); mpu_write_byte(prog&0x7F);
-}
-static void midi_cc(unsigned ch, unsigned cc, unsigned val){
-    mpu_write_byte(0xB0 | (ch&0x0F)); mpu_write_byte(cc & 0x7F); mpu_write_byte(val & 0x7F);
-}
-static void midi_all_notes_off(unsigned ch){
-    mpu_write_byte(0xB0 | (ch&0x0F)); mpu_write_byte(123); mpu_write_byte(0);
-}
-
-/* delay for arbitrary milliseconds (delay() takes int) */
-static void delay_ms_ul(unsigned long ms){
-    while(ms){
-        unsigned chunk = (ms > 32000UL) ? 32000U : (unsigned)ms;
-        delay((int)chunk);
-        ms -= chunk;
-    }
-}
+#include <stdio.h>   /* printf, sprintf */
+#include <stdlib.h>  /* atoi */
+#include <string.h>  /* memset, strcmp */
+#include "music3.h"
 
-/* ===== Visual (ASCII oscilloscope, single averaged trace) ===== */
-static const signed char SINE[128] = {
-   0,  5, 10, 15, 20, 24, 29, 33, 37, 41, 45, 48, 52, 55, 58, 61,
-  64, 66, 69, 71, 73, 75, 76, 78, 79, 80, 81, 82, 82, 83, 83, 83,
-  83, 83, 82, 82, 81, 80, 79, 78, 76, 75, 73, 71, 69, 66, 64, 61,
-  58, 55, 52, 48, 45, 41, 37, 33, 29, 24, 20, 15, 10,  5,  0, -5,
- -10,-15,-20,-24,-29,-33,-37,-41,-45,-48,-52,-55,-58,-61,-64,-66,
- -69,-71,-73,-75,-76,-78,-79,-80,-81,-82,-82,-83,-83,-83,-83,-83,
- -82,-82,-81,-80,-79,-78,-76,-75,-73,-71,-69,-66,-64,-61,-58,-55,
- -52,-48,-45,-41,-37,-33,-29,-24,-20,-15,-10,-5
-};
-#define SW 80
-#define SH 24
-static unsigned freq10_to_step(unsigned freq10){ unsigned long num=(unsigned long)freq10*256UL; return (unsigned)(num/2500U); }
-static void draw_wave(unsigned step, unsigned amp, unsigned char mid, unsigned char ch){
-    unsigned phase=0; int x;
-    for(x=0;x<SW;x++){
-        signed char s = SINE[phase & 0x7F];
-        int y = (int)mid - ((int)amp * (int)s) / 100;
-        if(y<1) y=1; if(y>SH) y=SH;
-        gotoxy(x+1,y); cputch(ch);
-        phase += step;
-    }
-}
-/* averaged trace */
-static void draw_avg_trace(const unsigned short *f10, int n){
-    int i; unsigned long acc=0;
-    if(n<=0){ int x; gotoxy(1,12); for(x=0;x<SW;x++) cputch('-'); return; }
-    for(i=0;i<n;i++) acc += f10[i];
-    { unsigned avg = (unsigned)(acc/(unsigned)n); unsigned step=freq10_to_step(avg); draw_wave(step,10,12,'*'); }
-}
+const M3Io *g_io;
 
 /* ===== Interactive key map (scancode set 1) ===== */
-typedef struct { unsigned char sc; unsigned char note; unsigned short f10; } Key;
-static const Key KEYS[] = {
-  {0x1E,60,2616},{0x11,61,2772},{0x1F,62,2937},{0x12,63,3111},
-  {0x20,64,3296},{0x21,65,3492},{0x14,66,3700},{0x22,67,3920},
-  {0x15,68,4153},{0x23,69,4400},{0x16,70,4662},{0x24,71,4939},
-  {0x25,72,5233},{0x18,73,5544},{0x19,74,5873},{0,0,0}
+const Key KEYS[] = {
+  {0x1E,60},{0x11,61},{0x1F,62},{0x12,63},
+  {0x20,64},{0x21,65},{0x14,66},{0x22,67},
+  {0x15,68},{0x23,69},{0x16,70},{0x24,71},
+  {0x25,72},{0x18,73},{0x19,74},{0,0}
 };
-static int idx_from_sc(unsigned char sc){ int i; for(i=0; KEYS[i].sc; ++i) if(KEYS[i].sc==sc) return i; return -1; }
+/* the ISR looks keys up here instead of scanning KEYS */
+signed char key_of_sc[128];
+void keymap_init(void){ int i; memset(key_of_sc, -1, sizeof(key_of_sc)); for(i=0; KEYS[i].sc; ++i) key_of_sc[KEYS[i].sc & 0x7F] = (signed char)i; }
+int idx_from_sc(unsigned char sc){ return sc < 128 ? key_of_sc[sc] : -1; }
 
-/* ===== Interactive mode: INT 9 ISR ===== */
-volatile unsigned char key_down[16];
+/* Written by the backend's keyboard ISR */
 volatile unsigned char esc_down = 0;
 volatile unsigned char space_down = 0;
-static void (__interrupt __far *old_int9)(void) = 0;
 
-void __interrupt __far kb_isr(void){
-    unsigned char sc   = inb(0x60);
-    unsigned char make = (sc & 0x80) ? 0 : 1;
-    unsigned char code = sc & 0x7F;
+/* ===== Key event queue: single producer (ISR), single consumer (main loop) ===== */
+static volatile KeyEvent key_q[KEYQ_SIZE];
+static volatile unsigned char key_q_head = 0, key_q_tail = 0;
+volatile unsigned key_q_lost = 0;
 
-    if(code==0x01){ esc_down   = make ? 1 : 0; }      /* ESC */
-    else if(code==0x39){ space_down = make ? 1 : 0; } /* Space */
-    else {
-        int idx = idx_from_sc(code);
-        if(idx >= 0) key_down[idx] = make ? 1 : 0;
-    }
-    /* ACK keyboard + EOI */
-    { unsigned char v = inb(0x61); outb(0x61,(unsigned char)(v|0x80)); outb(0x61,(unsigned char)(v&0x7F)); }
-    outb(0x20,0x20);
+void key_push(int idx, int make, unsigned long t){
+    unsigned char h = key_q_head, nh = (unsigned char)((h + 1) & (KEYQ_SIZE - 1));
+    if(nh == key_q_tail){ key_q_lost++; g_tm[TM_KEY_LOST]++; return; }      /* full: main loop stalled */
+    key_q[h].t = t; key_q[h].idx = (unsigned char)idx; key_q[h].make = (unsigned char)make;
+    key_q_head = nh;                                     /* publish after the slot is written */
 }
-
-/* ===== Tempo / beat-unit state ===== */
-static unsigned g_tempo_bpm = 120;           /* T=... */
-typedef enum { BEAT_Q, BEAT_E, BEAT_H, BEAT_W, BEAT_S, BEAT_DQ } beat_t;
-static beat_t g_beat = BEAT_Q;               /* B=... (default quarter) */
-static unsigned long g_quarter_ms = 500UL;   /* derived ms for one quarter */
-static unsigned g_program = 0;               /* instrument program */
-static unsigned g_sustain = 0;               /* 0/1 -> CC64 off/on */
-static unsigned g_overlap_ms = 20;           /* grace overlap between events */
-
-/* compute g_quarter_ms from g_tempo_bpm and g_beat */
-static void recompute_quarter_ms(void){
-    unsigned long beat_ms = (g_tempo_bpm ? (60000UL / (unsigned long)g_tempo_bpm) : 500UL);
-    switch(g_beat){
-        case BEAT_Q:  g_quarter_ms = beat_ms;                break; /* 1 beat = quarter */
-        case BEAT_H:  g_quarter_ms = beat_ms / 2UL;          break; /* beat is half note */
-        case BEAT_W:  g_quarter_ms = beat_ms / 4UL;          break; /* beat is whole    */
-        case BEAT_E:  g_quarter_ms = beat_ms * 2UL;          break; /* beat is eighth   */
-        case BEAT_S:  g_quarter_ms = beat_ms * 4UL;          break; /* beat is 16th     */
-        case BEAT_DQ: g_quarter_ms = (beat_ms * 2UL) / 3UL;  break; /* beat is dotted quarter */
-    }
-    if(g_quarter_ms == 0) g_quarter_ms = 1;
+int key_pop(KeyEvent *e){
+    unsigned char t = key_q_tail;
+    if(t == key_q_head) return 0;
+    e->t = key_q[t].t; e->idx = key_q[t].idx; e->make = key_q[t].make;
+    key_q_tail = (unsigned char)((t + 1) & (KEYQ_SIZE - 1));
+    return 1;
 }
 
-/* ===== Shared parser helpers ===== */
-static const char* skip_ws(const char *p){ while(*p && isspace(*p)) ++p; return p; }
+/* ===== MIDI input queue: bytes with their arrival time, same scheme as the keys ===== */
+static volatile MidiInByte midi_q[MIDIQ_SIZE];
+static volatile unsigned char midi_q_head = 0, midi_q_tail = 0;
 
-/* Parse NoteName[#|b]Octave -> MIDI (C4=60). *adv gets consumed chars. -1 on fail */
-static int note_from_name(const char *p, int *adv){
-    int i=0, sem=0, oct=4, midi=-1; char c = toupper(p[i]);
-    if(c<'A'||c>'G') return -1;
-    switch(c){ case 'C': sem=0; break; case 'D': sem=2; break; case 'E': sem=4; break;
-               case 'F': sem=5; break; case 'G': sem=7; break; case 'A': sem=9; break; case 'B': sem=11; break; }
-    i++;
-    if(p[i]=='#'){ sem++; i++; } else if(p[i]=='b'||p[i]=='B'){ sem--; i++; }
-    if(!isdigit(p[i])) return -1;
-    oct=0; while(isdigit(p[i])){ oct = oct*10 + (p[i]-'0'); i++; }
-    midi = 12*(oct+1) + sem; /* C-1=0 → C4=60 */
-    if(adv) *adv = i; return midi;
+void midi_in_push(unsigned char b, unsigned long t){
+    unsigned char h = midi_q_head, nh = (unsigned char)((h + 1) & (MIDIQ_SIZE - 1));
+    g_tm[TM_MIDI_IN]++;
+    if(nh == midi_q_tail){ g_tm[TM_MIDI_IN_LOST]++; return; }
+    midi_q[h].t = t; midi_q[h].b = b;
+    midi_q_head = nh;
 }
-
-/* MIDI note -> approximate frequency*10 (C4..B4 table, octave shift) */
-static unsigned short midi_to_freq10(int midi){
-    static const unsigned short base[12] = {
-        2616,2772,2937,3111,3296,3492,3700,3920,4153,4400,4662,4939 /* C..B for octave 4 */
-    };
-    int rel = midi - 60;                 /* relative to C4 */
-    int octave = rel / 12;
-    int sem    = rel % 12;
-    unsigned long f;
-
-    if(sem < 0){ sem += 12; octave--; }
-    f = base[sem];
-    while(octave > 0){ f <<= 1; octave--; }  /* up octaves */
-    while(octave < 0){ f >>= 1; octave++; }  /* down octaves */
-    if(f > 60000UL) f = 60000UL;
-    return (unsigned short)f;
+int midi_in_pop(MidiInByte *m){
+    unsigned char t = midi_q_tail;
+    if(t == midi_q_head) return 0;
+    m->t = midi_q[t].t; m->b = midi_q[t].b;
+    midi_q_tail = (unsigned char)((t + 1) & (MIDIQ_SIZE - 1));
+    return 1;
 }
 
-/* Duration ms from token letter (w,h,q,e,s) and dotted flag, using global quarter */
-static unsigned long dur_ms_from_token(char d, int dotted){
-    unsigned long num=1, den=1;
-    switch(d){
-        case 'w': num=4; den=1; break;   /* 4 quarters  */
-        case 'h': num=2; den=1; break;   /* 2 quarters  */
-        case 'q': num=1; den=1; break;   /* 1 quarter   */
-        case 'e': num=1; den=2; break;   /* 1/2 quarter */
-        case 's': num=1; den=4; break;   /* 1/4 quarter */
-        default : num=1; den=1; break;
-    }
-    { unsigned long ms = (g_quarter_ms * num) / den; if(dotted) ms = (ms*3UL)/2UL; if(ms==0) ms=1; return ms; }
+/* Offline conversion: no MPU, no screen, no real-time waits */
+static int convert_to_smf(const char *in, const char *out){
+    Score sc;
+    if(!load_score(in, &sc)){ printf("%s: %s\n", in, sc.err ? sc.err : "cannot read score"); return 1; }
+    if(score_truncated(&sc)) printf("%s: warning: score truncated to %lu events\n", in, score_events(&sc));
+    if(!smf_write(out, &sc)){ printf("%s: cannot write\n", out); score_free(&sc); return 1; }
+    printf("%s -> %s: %lu events in %u voice(s), %lu ms, %lu bytes of event memory\n", in, out, score_events(&sc), sc.nv, sc.len, score_bytes(&sc));
+    score_free(&sc);
+    return 0;
 }
 
-/* ===== Visualization frame for an array of frequencies (averaged trace) ===== */
-static void animate_notes_for(unsigned long ms, const unsigned short *freq10, int count, unsigned tempo, unsigned program){
-    unsigned long elapsed = 0; const unsigned frame = 30;
-    (void)tempo; (void)program;
-    while(elapsed < ms){
-        cls_area();
-        gotoxy(1,1); cputs("Playing sheet...  Esc=stop");
-        { char buf[80]; gotoxy(1,2); sprintf(buf,"Tempo:%u  Beat:%d  Notes:%d  OVL:%ums  SUS:%s",
-            g_tempo_bpm, (int)g_beat, count, (unsigned)g_overlap_ms, g_sustain ? "ON":"OFF"); cputs(buf); }
-        draw_avg_trace(freq10, count);
-        delay((int)frame);
-        elapsed += frame;
-        if(kbhit()){ int ch = getch(); if(ch==27) break; } /* ESC abort */
-    }
+/* ===== Interactive polyphonic keyboard mode ===== */
+/* Key events and MIDI input are turned into MIDI the moment the loop sees
+   them, oldest first; the screen is redrawn at most every FRAME_MS in
+   between, only after something changed it, and never holds a note back. */
+#define LIVE_IN 32                           /* notes held on the MIDI input shown and released */
+typedef struct {
+    unsigned char was_down[16];
+    unsigned char in_note[LIVE_IN], in_ch[LIVE_IN];
+    int n_in;
+    unsigned char st, d[2], nd;              /* MIDI input parser */
+    unsigned char rec;
+    unsigned long lat_last, lat_max, lat_sum, lat_n;
+} Live;
+
+static int live_key(Live *l, const KeyEvent *ev){
+    unsigned long lat;
+    int i = ev->idx;
+    if(ev->make && !l->was_down[i]){ midi_note_on(0, KEYS[i].note, 100); l->was_down[i]=1; if(l->rec) rec_event(ev->t, 0x90, KEYS[i].note, 100); }
+    else if(!ev->make && l->was_down[i]){ midi_note_off(0, KEYS[i].note, 64); l->was_down[i]=0; if(l->rec) rec_event(ev->t, 0x80, KEYS[i].note, 64); }
+    else return 0;                           /* typematic repeat: nothing sent */
+    /* key-to-MIDI: ISR timestamp to the bytes being queued */
+    lat = g_io->now() - ev->t;
+    l->lat_last = lat; l->lat_sum += lat; l->lat_n++;
+    if(lat > l->lat_max) l->lat_max = lat;
+    return 1;
 }
 
-/* ===== Note helpers honoring sustain & overlap ===== */
-static void play_single_note(unsigned midi, unsigned long ms){
-    unsigned short f10 = midi_to_freq10((int)midi);
-    midi_note_on(0, midi, 100);
-    animate_notes_for(ms, &f10, 1, g_tempo_bpm, g_program);
-    if(g_overlap_ms && !g_sustain){
-        delay_ms_ul(g_overlap_ms);
-    }
-    midi_note_off(0, midi, 64);
-    if(g_sustain){
-        /* With sustain ON, pedal holds sound even after note-off; no extra handling needed here. */
+/* Running status; realtime bytes (clock, active sensing, the MPU's ACKs) are
+   skipped and system messages drop the status. Notes, controllers and
+   programs go straight through to the output; returns 1 if the notes changed. */
+static int live_byte(Live *l, const MidiInByte *m){
+    unsigned ch, k, i;
+    if(m->b >= 0xF8) return 0;
+    if(m->b & 0x80){ l->st = (unsigned char)(m->b < 0xF0 ? m->b : 0); l->nd = 0; return 0; }
+    if(!l->st) return 0;                     /* sysex data, or no status yet */
+    l->d[l->nd++] = m->b;
+    if(l->nd < ((l->st & 0xE0) == 0xC0 ? 1 : 2)) return 0;   /* program and channel pressure: one data byte */
+    l->nd = 0;
+    ch = l->st & 0x0F; k = l->st & 0xF0;
+    if(k == 0x90 && l->d[1] == 0) k = 0x80;
+    for(i=0; i<(unsigned)l->n_in && (l->in_note[i] != l->d[0] || l->in_ch[i] != ch); i++) ;
+    switch(k){
+        case 0x90:
+            midi_note_on(ch, l->d[0], l->d[1]);
+            if(i == (unsigned)l->n_in && l->n_in < LIVE_IN){ l->in_note[l->n_in] = l->d[0]; l->in_ch[l->n_in] = (unsigned char)ch; l->n_in++; }
+            break;
+        case 0x80:
+            midi_note_off(ch, l->d[0], l->d[1]);
+            if(i < (unsigned)l->n_in){ l->n_in--; l->in_note[i] = l->in_note[l->n_in]; l->in_ch[i] = l->in_ch[l->n_in]; }
+            break;
+        case 0xB0: midi_cc(ch, l->d[0], l->d[1]); break;
+        case 0xC0: midi_prog_change(ch, l->d[0]); break;
+        default: return 0;                   /* aftertouch, pitch bend: no output for them */
     }
+    if(l->rec) rec_event(m->t, (unsigned char)(k | ch), l->d[0], l->d[1]);
+    return k == 0x90 || k == 0x80;
 }
 
-static void play_chord(const int *notes, int count, unsigned long ms){
-    int i; unsigned short list[8]; int n=0;
-    for(i=0;i<count;i++){ if(notes[i]>=0){ midi_note_on(0,(unsigned)notes[i],100); list[n++] = midi_to_freq10(notes[i]); } }
-    animate_notes_for(ms, list, n, g_tempo_bpm, g_program);
-    if(g_overlap_ms && !g_sustain) delay_ms_ul(g_overlap_ms);
-    for(i=0;i<count;i++) if(notes[i]>=0) midi_note_off(0,(unsigned)notes[i],64);
-}
-
-/* ===== Sheet player (with B=, SUS=, OVL=) ===== */
-static int play_sheet_file(const char *path){
-    FILE *f = fopen(path, "rt");
-    char line[256];
-    if(!f){ cls_area(); gotoxy(1,2); cputs("Could not open file."); delay(1000); return 1; }
-
-    /* reset runtime state for file */
-    g_tempo_bpm = 120; g_beat = BEAT_Q; recompute_quarter_ms();
-    g_program = 0; g_sustain = 0; g_overlap_ms = 20;
-
-    midi_all_notes_off(0);
-    midi_cc(0,64,0);                /* ensure pedal up */
-    midi_prog_change(0,g_program);
-
-    cls_area(); gotoxy(1,1); cputs("Playing: "); cputs(path);
-
-    while(fgets(line,sizeof(line),f)){
-        const char *p = line; char *cmt;
-        /* strip comments */
-        cmt = strchr(line,'#'); if(cmt) *cmt=0;
-        cmt = strchr(line,';'); if(cmt) *cmt=0;
+/* rec_path: record the take and write it there (.mid or sheet) once Esc ends it */
+static int play_interactive(const char *rec_path, unsigned grid){
+    static Live l;
+    int i, has_kbd, has_in;
+    unsigned char dirty = 1, got;
+    unsigned long next_frame;
+    KeyEvent kev;
+    MidiInByte mb;
+    memset(&l,0,sizeof(l)); memset(&mb,0,sizeof(mb));
+
+    keymap_init();
+    has_kbd = g_io->kbd_install();
+    has_in = g_io->midi_in_install();
+    if(!has_kbd && !has_in){ scr_clear(); scr_puts(1,12,"No live keyboard or MIDI input on this backend."); scr_present(); return 1; }
+    if(rec_path && !rec_open(REC_MAX)){
+        if(has_kbd) g_io->kbd_remove();
+        if(has_in) g_io->midi_in_remove();
+        scr_clear(); scr_puts(1,12,"Not enough memory to record."); scr_present(); return 1;
+    }
+    l.rec = rec_path != 0;
 
-        p = skip_ws(p);
-        while(*p){
-            if(*p=='|'){ p++; continue; }
-            if(isspace(*p)){ p=skip_ws(p); continue; }
+    next_frame = g_io->now();
+    while(1){
+        if(esc_down) break;
 
-            /* Tempo: T=### (beats per chosen beat unit) */
-            if( (p[0]=='T'||p[0]=='t') && p[1]=='=' ){
-                unsigned v=0; p+=2; while(isdigit(*p)){ v=v*10+(*p-'0'); p++; }
-                if(v>0 && v<800){ g_tempo_bpm = v; recompute_quarter_ms(); }
-                continue;
-            }
-            /* Beat unit: B=Q|E|H|W|S|DQ */
-            if( (p[0]=='B'||p[0]=='b') && p[1]=='=' ){
-                p+=2;
-                if( (p[0]=='D'||p[0]=='d') && (p[1]=='Q'||p[1]=='q') ){
-                    g_beat = BEAT_DQ; p+=2;
-                } else {
-                    char u = (char)toupper(*p);
-                    if(u=='Q') g_beat=BEAT_Q;
-                    else if(u=='E') g_beat=BEAT_E;
-                    else if(u=='H') g_beat=BEAT_H;
-                    else if(u=='W') g_beat=BEAT_W;
-                    else if(u=='S') g_beat=BEAT_S;
-                    if(*p) p++;
-                }
-                recompute_quarter_ms();
-                continue;
-            }
-            /* Instrument: I=### */
-            if( (p[0]=='I'||p[0]=='i') && p[1]=='=' ){
-                unsigned v=0; p+=2; while(isdigit(*p)){ v=v*10+(*p-'0'); p++; }
-                if(v<128){ g_program=v; midi_prog_change(0,g_program); }
-                continue;
-            }
-            /* Sustain pedal: SUS=ON|OFF */
-            if( (p[0]=='S'||p[0]=='s') && (p[1]=='U'||p[1]=='u') && (p[2]=='S'||p[2]=='s') && p[3]=='=' ){
-                p+=4;
-                if( (p[0]=='O'||p[0]=='o') && (p[1]=='N'||p[1]=='n') ){ g_sustain=1; midi_cc(0,64,127); p+=2; }
-                else if( (p[0]=='O'||p[0]=='o') && (p[1]=='F'||p[1]=='f') && (p[2]=='F'||p[2]=='f') ){ g_sustain=0; midi_cc(0,64,0); p+=3; }
-                continue;
-            }
-            /* Overlap: OVL=ms */
-            if( (p[0]=='O'||p[0]=='o') && (p[1]=='V'||p[1]=='v') && (p[2]=='L'||p[2]=='l') && p[3]=='=' ){
-                unsigned v=0; p+=4; while(isdigit(*p)){ v=v*10+(*p-'0'); p++; }
-                if(v<=200) g_overlap_ms = (unsigned)v; /* clamp */
-                continue;
+        {   /* keys and MIDI input, merged by timestamp */
+            int hk = key_pop(&kev), hm = midi_in_pop(&mb);
+            got = (unsigned char)(hk || hm);
+            while(hk || hm){
+                if(hk && (!hm || (long)(kev.t - mb.t) <= 0)){ if(live_key(&l, &kev)) dirty = 1; hk = key_pop(&kev); }
+                else { if(live_byte(&l, &mb)) dirty = 1; hm = midi_in_pop(&mb); }
             }
+        }
 
-            /* Rest: R<dur><.> */
-            if(*p=='R' || *p=='r'){
-                char d='q'; int dotted=0; unsigned long ms;
-                p++;
-                if(*p){ char c=(char)tolower(*p); if(strchr("whqes",c)){ d=c; p++; } }
-                if(*p=='.'){ dotted=1; p++; }
-                ms = dur_ms_from_token(d,dotted);
-                /* Visualize rest as flat line */
-                { unsigned short none=0; animate_notes_for(ms,&none,0,g_tempo_bpm,g_program); }
-                continue;
+        if(space_down){
+            for(i=0; KEYS[i].sc; ++i){
+                if(l.was_down[i]) { midi_note_off(0, KEYS[i].note, 64); l.was_down[i]=0; if(l.rec) rec_event(g_io->now(), 0x80, KEYS[i].note, 64); }
             }
+            midi_all_notes_off(0); space_down=0; dirty = 1;
+        }
 
-            /* Chord: [notes] <dur> <.> */
-            if(*p=='['){
-                int mids[8]; int ncount=0, adv=0, midi;
-                char d='q'; int dotted=0;
-                p++;
-                while(*p && *p!=']' && ncount<8){
-                    p=skip_ws(p);
-                    midi = note_from_name(p,&adv);
-                    if(midi>=0){ mids[ncount++]=midi; p+=adv; }
-                    else { while(*p && !isspace(*p) && *p!=']') p++; }
-                    p=skip_ws(p);
-                }
-                if(*p==']') p++;
-                p=skip_ws(p);
-                if(*p){ char c=(char)tolower(*p); if(strchr("whqes",c)){ d=c; p++; } }
-                if(*p=='.'){ dotted=1; p++; }
-                if(ncount>0){
-                    unsigned long ms = dur_ms_from_token(d,dotted);
-                    play_chord(mids,ncount,ms);
-                }
-                continue;
-            }
+        if((long)(g_io->now() - next_frame) < 0 || !dirty){
+            if(!got) g_io->wait_until(g_io->now() + 1);   /* what moves a virtual clock */
+            continue;
+        }
+        dirty = 0;
 
-            /* Single note: Name[#|b]Oct <dur><.> */
-            {
-                int adv=0; int midi = note_from_name(p,&adv);
-                if(midi>=0){
-                    char d='q'; int dotted=0; unsigned long ms;
-                    p+=adv;
-                    if(*p){ char c=(char)tolower(*p); if(strchr("whqes",c)){ d=c; p++; } }
-                    if(*p=='.'){ dotted=1; p++; }
-                    ms = dur_ms_from_token(d,dotted);
-                    play_single_note((unsigned)midi, ms);
-                    continue;
-                }
+        /* summed trace for all active notes */
+        {
+            unsigned char list[16 + LIVE_IN]; int n=0;
+            char buf[80];
+            scr_clear();
+            for(i=0; KEYS[i].sc; ++i) if(l.was_down[i]) list[n++] = KEYS[i].note;
+            for(i=0; i<l.n_in; ++i) list[n++] = l.in_note[i];
+            draw_scope(list, n);
+            scr_puts(1,1,"Poly mode: hold multiple keys  A..K with W/E/T/Y/U/O/P");
+            scr_puts(1,2,"Space = All Notes Off   |   Esc = Quit");
+            if(has_in || l.rec){
+                sprintf(buf,"MIDI in: %lu bytes, %lu lost%s", g_tm[TM_MIDI_IN], g_tm[TM_MIDI_IN_LOST], l.rec ? "   |   Recording" : "");
+                if(l.rec) sprintf(buf + strlen(buf), ": %u events%s", rec_count(), g_tm[TM_REC_LOST] ? ", full" : "");
+                scr_puts(1,3,buf);
             }
-
-            /* Unknown token: skip to next space/bar */
-            while(*p && !isspace(*p) && *p!='|') p++;
+            sprintf(buf,"Key->MIDI: last %lu ms  max %lu ms  avg %lu.%lu ms  (%lu keys, %u lost)",
+                l.lat_last, l.lat_max, l.lat_n ? l.lat_sum/l.lat_n : 0UL, l.lat_n ? (l.lat_sum*10UL/l.lat_n)%10UL : 0UL, l.lat_n, key_q_lost);
+            scr_puts(1,SCR_H,buf);
+            scr_present();
         }
+
+        /* pace frames on the backend clock; after an overrun start from now, don't burst */
+        next_frame += FRAME_MS;
+        if((long)(g_io->now() - next_frame) > 0) next_frame = g_io->now();
     }
 
-    fclose(f);
+    for(i=0; KEYS[i].sc; ++i) if(l.was_down[i]) midi_note_off(0, KEYS[i].note, 64);
+    for(i=0; i<l.n_in; ++i) midi_note_off(l.in_ch[i], l.in_note[i], 64);
     midi_all_notes_off(0);
     midi_cc(0,64,0); /* pedal up */
-    cls_area(); gotoxy(1,12); cputs("Done. Press any key...");
-    getch();
+    if(has_kbd) g_io->kbd_remove();
+    if(has_in) g_io->midi_in_remove();
+
+    scr_clear();
+    if(l.rec){
+        /* everything held is released at the end of the take */
+        char buf[80];
+        unsigned n = rec_count();
+        int ok = rec_write(rec_path, grid, g_io->now());
+        sprintf(buf, ok ? "Recorded %u events to " : "Could not write %u events to ", n);
+        scr_puts(1,12,buf); scr_puts((int)strlen(buf) + 1,12,rec_path);
+        if(!ok){ scr_present(); return 1; }
+    }
+    else scr_puts(1,12,"Goodbye.");
+    scr_present();
     return 0;
 }
 
-/* ===== main: if file given => play; else interactive ISR mode ===== */
+/* ===== main: if file given => play (or convert with -o); else interactive ISR mode ===== */
 int main(int argc, char **argv){
-    int i;
-    unsigned char was_down[16];
-    memset((void*)was_down,0,sizeof(was_down));
-    cls_area();
-    mpu_init_uart();
-
-    /* defaults */
-    g_tempo_bpm = 120; g_beat = BEAT_Q; recompute_quarter_ms();
-    g_program = 0; g_sustain = 0; g_overlap_ms = 20;
-    midi_cc(0,64,0); midi_prog_change(0,g_program);
-
-    if(argc >= 2){
-        return play_sheet_file(argv[1]);
+    int i, rc;
+    const char *in_path = 0, *out_mid = 0, *cap_path = 0, *wav_path = 0, *log_path = 0, *rec_path = 0, *midi_in = 0;
+    unsigned rate = 22050U, grid = 16U;
+
+    g_io = m3_default_io();
+    for(i=1;i<argc;i++){
+        if(strcmp(argv[i],"-o")==0 && i+1<argc) out_mid = argv[++i];
+        else if(strcmp(argv[i],"-c")==0 && i+1<argc) cap_path = argv[++i];
+        else if(strcmp(argv[i],"-w")==0 && i+1<argc) wav_path = argv[++i];
+        else if(strcmp(argv[i],"-r")==0 && i+1<argc) rate = (unsigned)atoi(argv[++i]);
+        else if(strcmp(argv[i],"-l")==0 && i+1<argc) log_path = argv[++i];
+        else if(strcmp(argv[i],"-t")==0) g_tm_overlay = 1;
+        else if(strcmp(argv[i],"-R")==0 && i+1<argc) rec_path = argv[++i];
+        else if(strcmp(argv[i],"-q")==0 && i+1<argc) grid = (unsigned)atoi(argv[++i]);
+        else if(strcmp(argv[i],"-i")==0 && i+1<argc) midi_in = argv[++i];
+        else in_path = argv[i];
     }
-
-    /* Interactive polyphonic keyboard mode */
-    _disable(); old_int9 = _dos_getvect(9); _dos_setvect(9, kb_isr); _enable();
-    gotoxy(1,1); cputs("Poly mode: hold multiple keys  A..K with W/E/T/Y/U/O/P");
-    gotoxy(1,2); cputs("Space = All Notes Off   |   Esc = Quit");
-
-    while(1){
-        if(esc_down) break;
-
-        if(space_down){
-            for(i=0; KEYS[i].sc; ++i){
-                if(was_down[i]) { midi_note_off(0, KEYS[i].note, 64); was_down[i]=0; }
-            }
-            midi_all_notes_off(0); space_down=0;
-        }
-
-        for(i=0; KEYS[i].sc; ++i){
-            unsigned char cur = key_down[i];
-            if(cur && !was_down[i]){ midi_note_on(0, KEYS[i].note, 100); was_down[i]=1; }
-            else if(!cur && was_down[i]){ midi_note_off(0, KEYS[i].note, 64); was_down[i]=0; }
-        }
-
-        /* averaged trace for all active notes */
-        {
-            unsigned short list[16]; int n=0, x;
-            cls_area();
-            for(i=0; KEYS[i].sc; ++i) if(was_down[i]) list[n++] = KEYS[i].f10;
-            if(n>0) draw_avg_trace(list, n);
-            else { gotoxy(1,12); for(x=0;x<SW;x++) cputch('-'); }
-            gotoxy(1,1); cputs("Poly mode: hold multiple keys  A..K with W/E/T/Y/U/O/P");
-            gotoxy(1,2); cputs("Space = All Notes Off   |   Esc = Quit");
-        }
-
-        delay(30);
+    if(out_mid){
+        if(!in_path){ printf("usage: music3 sheet.txt -o out.mid\n"); return 2; }
+        return convert_to_smf(in_path, out_mid);
     }
+    /* -w: the built-in synth renders to a WAV file instead of driving the port */
+    if(wav_path){
+        if(!in_path){ printf("usage: music3 sheet.txt -w out.wav [-r 11025|22050|44100]\n"); return 2; }
+        if((g_io = synth_io(wav_path, rate)) == 0){ printf("%s: cannot write\n", wav_path); return 1; }
+    }
+    /* -R: record the live take (keys and MIDI input) */
+    if(rec_path && in_path){ printf("usage: music3 -R take.txt|take.mid [-q 0|4|8|16|32]\n"); return 2; }
+    if(grid != 0 && grid != 4 && grid != 8 && grid != 16 && grid != 32){ printf("-q: 0 (off), 4, 8, 16 or 32\n"); return 2; }
+    if(midi_in && !g_io->midi_in_file(midi_in)){ printf("%s: cannot take MIDI input from it on the %s backend\n", midi_in, g_io->name); return 1; }
+    if(cap_path && !g_io->capture(cap_path)){ printf("%s: cannot capture on the %s backend\n", cap_path, g_io->name); return 1; }
 
-    for(i=0; KEYS[i].sc; ++i) if(was_down[i]) midi_note_off(0, KEYS[i].note, 64);
-    midi_all_notes_off(0);
-    midi_cc(0,64,0); /* pedal up */
-    _disable(); _dos_setvect(9, old_int9); _enable();
+    scr_init(); scr_clear(); scr_present();
+    g_io->midi_reset();
+    midi_enc_reset();
 
-    cls_area(); gotoxy(1,12); cputs("Goodbye.");
-    return 0;
+    /* defaults */
+    midi_cc(0,64,0); midi_prog_change(0,0);
+
+    telem_reset(log_path != 0);
+    g_io->clock_start();
+    rc = in_path ? play_sheet_file(in_path) : play_interactive(rec_path, grid);
+    g_io->clock_stop();
+    scr_done(14);
+    if(wav_path && !synth_io_done()){ printf("%s: write failed\n", wav_path); rc = 1; }
+    if(log_path && !telem_write(log_path)){ printf("%s: cannot write\n", log_path); rc = 1; }
+    return rc;
 }
@@ -0,0 +1,347 @@
+/* Music3 shared declarations.
+   The core (sheet.c, score.c, smf.c, midiout.c, screen.c, player.c) is plain C89 and
+   never touches hardware: ports, clock, VRAM and keyboard go through the
+   M3Io backend. dosio.c is the DOSBox/MPU-401 backend, hostio.c the native
+   one that captures the MIDI byte stream with timestamps.
+*/
+#ifndef MUSIC3_H
+#define MUSIC3_H
+
+#include <stdio.h>
+
+/* ===== Output backend ===== */
+typedef struct {
+    const char *name;
+    /* MIDI port (MPU-401 UART on DOS) */
+    void (*midi_reset)(void);                /* reset + enter UART mode */
+    int  (*midi_ready)(void);                /* 1 if a data byte can go out now */
+    void (*midi_write)(unsigned char b);
+    /* clock: ms, absolute; start/stop bracket real-time playback */
+    void (*clock_start)(void);
+    void (*clock_stop)(void);
+    unsigned long (*now)(void);
+    void (*wait_until)(unsigned long ms);
+    /* screen: 80x25 cells, char in the low byte, attribute in the high byte */
+    void (*scr_open)(void);
+    void (*scr_cell)(unsigned idx, unsigned short cell);
+    void (*scr_close)(int row);              /* restore cursor, park it on row */
+    /* keyboard: -1 when no key; wait=1 blocks until one arrives */
+    int  (*key)(int wait);
+    /* live keyboard (INT 9 on DOS); 0 if the backend has none */
+    int  (*kbd_install)(void);
+    void (*kbd_remove)(void);
+    /* send a copy of every MIDI byte, timestamped, to a file; 0 if unsupported */
+    int  (*capture)(const char *path);
+    /* MIDI input: each byte goes to midi_in_push with its arrival time (INT 8
+       polls the MPU on DOS); 0 if the backend has none */
+    int  (*midi_in_install)(void);
+    void (*midi_in_remove)(void);
+    /* take the input from a capture-format file instead; 0 if unsupported */
+    int  (*midi_in_file)(const char *path);
+} M3Io;
+
+extern const M3Io *g_io;
+const M3Io *m3_default_io(void);             /* provided by the linked backend */
+
+/* ===== Timeline (sheet.c) ===== */
+typedef enum { BEAT_Q, BEAT_E, BEAT_H, BEAT_W, BEAT_S, BEAT_DQ,
+               BEAT_US } beat_t;                  /* BEAT_US: a .mid tempo, us per quarter in d2:w */
+
+enum { EV_NOTE_ON, EV_NOTE_OFF, EV_CC, EV_PROG, EV_TEMPO, EV_OVL, EV_CALL, EV_NKIND };
+
+typedef struct {
+    unsigned long  t;      /* ms from start of sheet (stored: ticks, see Score.ppq) */
+    unsigned char  kind;   /* EV_* */
+    unsigned char  ch;     /* MIDI channel */
+    unsigned char  d1;     /* note / controller / program / beat unit */
+    unsigned char  d2;     /* velocity / controller value */
+    unsigned short w;      /* EV_TEMPO: bpm, EV_OVL: overlap ms, EV_CALL: times played */
+} Event;                   /* EV_CALL: d1 pattern, d2 transpose (signed) */
+
+/* Sheets are timed in ticks at SCORE_PPQ a quarter, exact for every
+   duration down to a dotted sixteenth */
+#define SCORE_PPQ 960
+
+/* Tempo map position of one voice: its EV_TEMPO events start segments, and
+   ticks become ms from the segment start, so no rounding carries over */
+typedef struct {
+    unsigned long tick0, ms0, rem0;          /* segment start: ms0 + rem0/div */
+    unsigned long num, div;                  /* ms per tick = num/div */
+    unsigned ppq;
+} TempoMap;
+
+/* Far memory: the small model keeps its data in one 64 KB segment, so
+   scores live in blocks from the far heap */
+#if defined(__WATCOMC__) && defined(__I86__)
+#define M3FAR __far
+#else
+#define M3FAR
+#endif
+
+/* Bump allocator over a chain of blocks; rewinding keeps the blocks, so
+   refilling a window allocates nothing */
+typedef struct ArenaBlk ArenaBlk;
+struct ArenaBlk {
+    ArenaBlk M3FAR *next;
+    unsigned used, size;   /* data follows the header */
+};
+typedef struct {
+    ArenaBlk M3FAR *head;
+    ArenaBlk M3FAR *tail;
+    unsigned long bytes;   /* block data allocated */
+} Arena;
+
+/* One voice's events, packed (see score.c): a delta-time varint, a
+   kind/channel byte and one byte per note, about 2-3 bytes an event */
+typedef struct {
+    Arena ar;
+    unsigned long n;       /* events */
+    unsigned long last_t;  /* encoder state: time and velocities of the last record */
+    unsigned char vel_on, vel_off;
+    unsigned char full;    /* set once an event had to be dropped */
+} EvBuf;
+
+typedef struct {
+    const ArenaBlk M3FAR *blk;
+    unsigned off;
+    unsigned long left, t;
+    unsigned char vel_on, vel_off;
+} EvReader;
+
+/* Compiled once, played by reference: an EV_CALL plays the pattern's
+   events shifted to its own time, transposed and on its channel */
+#define PAT_MAX      256                     /* an EV_CALL names its pattern in one byte */
+#define PAT_DEPTH    4                       /* a voice plus three nested calls */
+#define PAT_NAME     8
+typedef struct {
+    EvBuf ev;              /* times from the pattern start */
+    char name[PAT_NAME];   /* P=name, "" for a repeat */
+    unsigned long len;     /* ticks; a repeat starts the next pass here */
+    unsigned char done;
+    unsigned char nest;    /* cursor frames one play takes: 1 + its deepest call, at most PAT_DEPTH-1 */
+    unsigned char tempo;   /* it changes the tempo, itself or in a call */
+} Pattern;
+
+/* A compiled score: one time-ordered stream per voice (V=n in a sheet,
+   one per track for a .mid), merged by timestamp when played */
+#define MAX_VOICES 8
+typedef struct Score Score;
+struct Score {
+    EvBuf v[MAX_VOICES];
+    unsigned nv;           /* voices 0..nv-1 may hold events */
+    unsigned long len;     /* ms, end of the longest voice; streamed: final once every voice ran out */
+    unsigned long ticks;   /* the same end in ticks */
+    unsigned ppq;          /* ticks per quarter of the stored times */
+    Pattern *pat;          /* npat of them, room for pat_cap; 0 until a sheet defines one */
+    unsigned npat, pat_cap;
+    const char *err;       /* why a sheet was refused (a streamed one may be, on a later window) */
+    /* streamed scores: v[] holds a window per voice, refill replaces it with
+       the next one (0 at the end); all three are 0 for a fully loaded score */
+    int  (*refill)(Score *sc, unsigned v);
+    void (*release)(Score *sc);
+    void *src;
+    unsigned met;          /* streamed: bit per voice the file has reached so far; cursors open the rest as they come */
+};
+
+/* Where a voice is reading: its own stream at the bottom, a pattern call above */
+typedef struct {
+    EvReader rd;
+    unsigned long base;    /* added to the event ticks */
+    unsigned reps;         /* passes left after this one */
+    signed char tr;        /* semitones */
+    unsigned char pat, ch;
+} CursorFrame;
+
+typedef struct {
+    Score *sc;
+    CursorFrame fr[MAX_VOICES][PAT_DEPTH];
+    unsigned char depth[MAX_VOICES];
+    Event ev[MAX_VOICES];  /* each voice's next event, decoded, t in ms */
+    unsigned long tick[MAX_VOICES];
+    TempoMap tm[MAX_VOICES];
+    unsigned char heap[MAX_VOICES];
+    unsigned nheap;
+    unsigned mask, open;   /* voices asked for, and those opened (a streamed score meets more as it is read) */
+    unsigned late;         /* opened after their first event was due: they play behind the others */
+    unsigned long played;  /* time of the last event moved past */
+} ScoreCursor;
+
+/* Sounding notes: one entry per (channel, note) with the number of
+   note-ons holding it. The player and the offline renderer both filter the
+   notes through one, so they play the same ones. */
+#define MAX_ACTIVE 32
+typedef struct {
+    unsigned char note[MAX_ACTIVE];          /* also the scope's note list */
+    unsigned char ch[MAX_ACTIVE], cnt[MAX_ACTIVE];
+    int n;
+} Sounding;
+
+/* score.c */
+unsigned char M3FAR *arena_alloc(Arena *a, unsigned n);
+void arena_rewind(Arena *a);
+void arena_free(Arena *a);
+void tempo_init(TempoMap *m, unsigned ppq);              /* 120 bpm, quarter beat */
+void tempo_set(TempoMap *m, unsigned long tick, const Event *e);   /* EV_TEMPO from tick on */
+unsigned long tempo_ms(const TempoMap *m, unsigned long tick);
+unsigned long tempo_ticks(const TempoMap *m, unsigned long ms);    /* rounded up */
+unsigned long tempo_us(const Event *e);      /* us per quarter of an EV_TEMPO */
+void ev_push(EvBuf *b, unsigned long t, unsigned char kind, unsigned char ch, unsigned char d1, unsigned char d2, unsigned w);
+void evbuf_clear(EvBuf *b);
+void evbuf_free(EvBuf *b);
+void ev_reader_init(EvReader *r, const EvBuf *b);
+int  ev_read(EvReader *r, Event *e);         /* 0 at the end */
+void score_free(Score *s);
+int score_pattern_new(Score *s);
+unsigned long score_events(const Score *s);
+unsigned long score_bytes(const Score *s);
+int  score_truncated(const Score *s);
+unsigned score_channels(const Score *s);
+void score_cursor_init(ScoreCursor *c, Score *sc);
+void score_cursor_voices(ScoreCursor *c, Score *sc, unsigned mask);   /* only the voices in mask */
+const Event *score_cursor_peek(const ScoreCursor *c);
+unsigned score_cursor_voice(const ScoreCursor *c);
+unsigned long score_cursor_tick(const ScoreCursor *c);   /* of the peeked event */
+void score_cursor_next(ScoreCursor *c);
+int  sounding_on(Sounding *s, unsigned ch, unsigned note);    /* 0: already sounding, send nothing */
+int  sounding_off(Sounding *s, unsigned ch, unsigned note);   /* 0: still held by another note-on */
+
+/* sheet.c */
+unsigned long compile_sheet(FILE *f, Score *out);
+int  sheet_stream_open(const char *path, Score *out);
+
+/* ===== Standard MIDI files (smf.c) ===== */
+int  smf_write(const char *path, Score *sc);
+unsigned long smf_read(FILE *f, Score *out);
+int  is_midi_path(const char *path);
+int  load_score(const char *path, Score *out);
+
+/* ===== MIDI output (midiout.c) ===== */
+#define TX_STALL_MS 100                      /* port busy this long => give up on the queue */
+extern volatile unsigned char g_tx_async;    /* 1 while a timer tick drains the queue */
+extern unsigned g_tx_overflow;
+extern volatile unsigned g_tx_dropped;
+extern unsigned long g_enc_saved;
+
+void mpu_pump(void);
+void mpu_drain_polled(void);
+void mpu_flush(unsigned ms);
+void midi_enc_reset(void);
+void midi_note_on (unsigned ch, unsigned note, unsigned vel);
+void midi_note_off(unsigned ch, unsigned note, unsigned vel);
+void midi_prog_change(unsigned ch, unsigned prog);
+void midi_cc(unsigned ch, unsigned cc, unsigned val);
+void midi_all_notes_off(unsigned ch);
+
+/* ===== Screen (screen.c) ===== */
+#define SCR_W 80
+#define SCR_H 25
+void scr_init(void);
+void scr_done(int row);
+void scr_clear(void);
+void scr_putc(int x, int y, char ch);
+void scr_puts(int x, int y, const char *s);
+unsigned scr_present(void);
+void draw_scope(const unsigned char *notes, int n);    /* MIDI notes, summed */
+
+/* ===== Player (player.c) ===== */
+#define FRAME_MS 30
+extern void (*g_dispatch_hook)(const Event *e, unsigned long now);   /* benchmarks: called before each event */
+int  play_timeline(Score *sc);
+void draw_play_frame(const unsigned char *notes, int count);
+int  play_sheet_file(const char *path);
+
+/* ===== Telemetry (telem.c) ===== */
+/* Always-on counters, bumped by the player, the MIDI output and the ISRs */
+enum { TM_EVENTS, TM_LATE_SUM, TM_LATE_MAX, TM_FRAMES, TM_FRAME_SUM, TM_FRAME_MAX,
+       TM_FRAME_SKIP, TM_FRAME_IDLE, TM_FRAME_RATE,   /* held back for an event, nothing to draw, drawn per s */
+       TM_MPU_SPINS, TM_MPU_TIMEOUTS, TM_TX_BUSY, TM_TX_STALLS, TM_TX_DROPPED,
+       TM_TX_OVERFLOW, TM_TIMER_ISR, TM_KEY_ISR, TM_KEY_LOST, TM_LOG_LOST,
+       TM_MIDI_IN, TM_MIDI_IN_LOST, TM_REC_LOST, TM_NCOUNT };
+enum { TM_REC_EVENT, TM_REC_FRAME };
+#define TM_HIST 10                           /* ms buckets: 0, 1, 2, 3-4, 5-8 ... >128 */
+#define TM_VERSION 3
+#ifndef TM_LOG_MAX
+#define TM_LOG_MAX 256                       /* records kept for the log (the latest) */
+#endif
+extern volatile unsigned long g_tm[TM_NCOUNT];
+extern unsigned long g_tm_late_hist[TM_HIST], g_tm_frame_hist[TM_HIST];
+extern unsigned char g_tm_overlay;           /* status line while playing */
+extern const char *const TM_NAMES[TM_NCOUNT];
+extern const char *const TM_BUCKETS[TM_HIST];
+void telem_reset(int log);
+void telem_event(unsigned char kind, unsigned long t, unsigned long late);
+void telem_frame(unsigned long t, unsigned long ms);
+void telem_overlay(void);
+int  telem_write(const char *path);
+
+/* ===== Software synth (synth.c) ===== */
+#define SYN_VOICES 16
+#define SYN_BLOCK  32                        /* samples per envelope step */
+typedef struct {
+    unsigned long phase, step;               /* 2^32 = one cycle */
+    unsigned long level, inc;                /* envelope, 2^24 = full */
+    const struct SynPatch *patch;
+    unsigned char stage, ch, note, vel, held;
+} SynVoice;
+typedef struct {
+    SynVoice v[SYN_VOICES];
+    unsigned rate;
+    unsigned char rate_shift;
+    unsigned char program[16];
+    unsigned pedal;                          /* bit per channel with CC64 down */
+    unsigned char status, d[2], nd;          /* MIDI parser */
+    unsigned noise;
+    unsigned long frames;                    /* samples rendered */
+    unsigned long stolen;                    /* notes that took a sounding voice */
+} Synth;
+void synth_init(Synth *s, unsigned rate);    /* 11025, 22050 or 44100 */
+void synth_midi(Synth *s, unsigned char b);
+void synth_render(Synth *s, short *out, unsigned n);
+unsigned synth_active(const Synth *s);
+void synth_event(Synth *s, const Event *e);
+void synth_render_score(Synth *s, Score *sc, unsigned long from_ms, unsigned long to_ms,
+                        void (*sink)(void *ctx, const short *pcm, unsigned n), void *ctx);
+FILE *wav_open(const char *path, unsigned rate);
+void wav_write(FILE *f, const short *pcm, unsigned n);
+int  wav_close(FILE *f, unsigned long frames);
+const M3Io *synth_io(const char *wav_path, unsigned rate);
+int  synth_io_done(void);
+
+/* ===== Interactive keys (music3.c, filled by the backend's keyboard ISR) ===== */
+typedef struct { unsigned char sc; unsigned char note; } Key;
+extern const Key KEYS[];
+extern signed char key_of_sc[128];           /* scancode -> KEYS index or -1, see keymap_init */
+extern volatile unsigned char esc_down;
+extern volatile unsigned char space_down;
+void keymap_init(void);
+int idx_from_sc(unsigned char sc);
+
+/* Make/break of the note keys, timestamped on the backend clock. The ISR is
+   the only producer and the main loop the only consumer, so the one-byte
+   head/tail need no locking. */
+#define KEYQ_SIZE 32                         /* power of two */
+typedef struct { unsigned long t; unsigned char idx, make; } KeyEvent;
+extern volatile unsigned key_q_lost;
+void key_push(int idx, int make, unsigned long t);   /* ISR side */
+int  key_pop(KeyEvent *e);                           /* main loop: 0 when empty */
+
+/* MIDI input bytes, timestamped by the backend as they arrive; the same
+   single producer / single consumer scheme as the keys */
+#define MIDIQ_SIZE 128                       /* power of two, at most 256 */
+typedef struct { unsigned long t; unsigned char b; } MidiInByte;
+void midi_in_push(unsigned char b, unsigned long t); /* ISR side */
+int  midi_in_pop(MidiInByte *m);                     /* main loop: 0 when empty */
+
+/* ===== Live recording (record.c) ===== */
+/* The buffer is allocated before the take; recording an event only stores
+   it. Pairing, quantizing and writing wait until the take is over. */
+#ifndef REC_MAX
+#define REC_MAX 4096U                        /* events a take can hold (12 bytes each, far) */
+#endif
+int  rec_open(unsigned n);                   /* 0 if there is no memory for n events */
+void rec_event(unsigned long t, unsigned char status, unsigned char d1, unsigned char d2);
+unsigned rec_count(void);
+int  rec_write(const char *path, unsigned grid, unsigned long t_end);   /* .mid or sheet; grid: notes per whole, 0 = none */
+void rec_free(void);
+
+#endif
@@ -0,0 +1,173 @@
+/* Timeline player: dispatches compiled events against the backend clock and
+   draws the oscilloscope in the gaps. Nothing is parsed here.
+*/
+#include <stdio.h>   /* sprintf */
+#include "music3.h"
+
+/* Display/playback state: follows the events as they are dispatched */
+static unsigned g_tempo_bpm = 120;           /* T=... */
+static beat_t g_beat = BEAT_Q;               /* B=... (default quarter) */
+static unsigned g_program = 0;               /* instrument program */
+static unsigned g_sustain = 0;               /* 0/1 -> CC64 off/on */
+static unsigned g_overlap_ms = 20;           /* grace overlap between events */
+static unsigned char g_view_dirty;           /* something on screen changed since the last frame */
+
+/* ===== Visualization frame for the sounding notes (summed trace) ===== */
+void draw_play_frame(const unsigned char *notes, int count){
+    scr_clear();
+    scr_puts(1,1,"Playing sheet...  Esc=stop  T=stats");
+    { char buf[80]; sprintf(buf,"Tempo:%u  Beat:%d  Notes:%d  OVL:%ums  SUS:%s",
+        g_tempo_bpm, (int)g_beat, count, (unsigned)g_overlap_ms, g_sustain ? "ON":"OFF"); scr_puts(1,2,buf); }
+    draw_scope(notes, count);
+    if(g_tm_overlay) telem_overlay();
+    scr_present();
+}
+
+/* ===== Timeline player: walks the compiled events, nothing is parsed here ===== */
+static Sounding g_sounding;              /* what the port is playing */
+static unsigned g_ch_used = 0;           /* bit per MIDI channel the score touched (and reset) */
+static unsigned g_late_voices = 0;       /* streamed voices the file reached after they were due */
+void (*g_dispatch_hook)(const Event *e, unsigned long now) = 0;
+
+/* key up on everything still sounding (ESC abort): the pedal and
+   all-notes-off that follow are not honoured by every synth */
+static void voices_release(void){
+    int i;
+    for(i=0;i<g_sounding.n;i++) midi_note_off(g_sounding.ch[i], g_sounding.note[i], 64);
+    g_sounding.n = 0;
+}
+
+/* notes off, pedal up, program 0 */
+static void channel_reset(unsigned ch){
+    midi_all_notes_off(ch);
+    midi_cc(ch,64,0);
+    midi_prog_change(ch,0);
+}
+
+static void dispatch_event(const Event *e){
+    int n = g_sounding.n;
+    /* tempo and overlap have no channel; a streamed score's later windows can
+       bring a channel the start did not know about: reset it on first use */
+    if(e->kind <= EV_PROG && !(g_ch_used & (1U << (e->ch & 0x0F)))){ channel_reset(e->ch & 0x0F); g_ch_used |= 1U << (e->ch & 0x0F); }
+    switch(e->kind){
+        case EV_NOTE_ON:
+            if(sounding_on(&g_sounding, e->ch, e->d1)) midi_note_on(e->ch, e->d1, e->d2);
+            if(g_sounding.n != n) g_view_dirty = 1;
+            break;
+        case EV_NOTE_OFF:
+            if(sounding_off(&g_sounding, e->ch, e->d1)) midi_note_off(e->ch, e->d1, e->d2);
+            if(g_sounding.n != n) g_view_dirty = 1;
+            break;
+        case EV_CC:
+            midi_cc(e->ch, e->d1, e->d2);
+            if(e->d1==64 && g_sustain != (e->d2 >= 64)){ g_sustain = (e->d2 >= 64); g_view_dirty = 1; }
+            break;
+        case EV_PROG:  g_program = e->d1; midi_prog_change(e->ch, e->d1); break;
+        case EV_TEMPO:
+            if(e->d1 == BEAT_US){ g_tempo_bpm = (unsigned)((60000000UL + tempo_us(e)/2UL) / tempo_us(e)); g_beat = BEAT_Q; }
+            else { g_tempo_bpm = e->w; g_beat = (beat_t)e->d1; }
+            g_view_dirty = 1;
+            break;
+        case EV_OVL:   g_overlap_ms = e->w; g_view_dirty = 1; break;
+    }
+}
+
+/* The screen is the lower-priority task: a frame is only drawn when the
+   notes or the status changed, at most every FRAME_MS, and not while an
+   event falls due within what a frame has been costing (unless frames have
+   been held back for FRAME_STALE_MS). The keys are still read every FRAME_MS. */
+#define FRAME_STALE_MS (4 * FRAME_MS)
+#define STAT_MS        250                   /* status line refresh while it is shown */
+
+/* Events fire against the absolute backend clock; a slow frame only delays the
+   events that fall inside it, never the ones after. The voices are merged by
+   timestamp as they play, so none of them waits on another. Returns 1 if aborted. */
+int play_timeline(Score *sc){
+    static ScoreCursor cur;                  /* pattern frames make it too big for a DOS stack */
+    const Event *e;
+    unsigned long t0 = g_io->now(), next_poll = 0, next_stat = 0, last_draw = 0UL - FRAME_MS, rate_t = 0, cost = 0;
+    unsigned rate_n = 0;
+    unsigned char held = 0;                  /* the frame that is due waits for an event */
+    score_cursor_init(&cur, sc);
+    g_sounding.n = 0; g_view_dirty = 1; g_late_voices = 0;
+    for(;;){
+        unsigned long now = g_io->now() - t0, next;
+        while((e = score_cursor_peek(&cur)) != 0 && e->t <= now){
+            if(g_dispatch_hook) g_dispatch_hook(e, now);
+            telem_event(e->kind, e->t, now - e->t);
+            dispatch_event(e);
+            score_cursor_next(&cur);
+        }
+        if(!e && now >= sc->len) break;
+        if((long)(now - next_poll) >= 0){
+            int k = g_io->key(0);
+            if(!g_view_dirty) g_tm[TM_FRAME_IDLE]++;
+            if(k==27){ voices_release(); return 1; } /* ESC abort */
+            if(k=='t' || k=='T'){ g_tm_overlay ^= 1; g_view_dirty = 1; }   /* telemetry status line */
+            next_poll = now + FRAME_MS;
+        }
+        if(g_tm_overlay && (long)(now - next_stat) >= 0){ g_view_dirty = 1; next_stat = now + STAT_MS; }
+        if(now - rate_t >= 1000UL){ g_tm[TM_FRAME_RATE] = (unsigned long)rate_n * 1000UL / (now - rate_t); rate_t = now; rate_n = 0; }
+        if(g_view_dirty && now - last_draw >= FRAME_MS){
+            if(e && e->t <= now + cost + 1UL && now - last_draw < FRAME_STALE_MS){
+                if(!held){ held = 1; g_tm[TM_FRAME_SKIP]++; }
+            }
+            else {
+                unsigned long ms;
+                draw_play_frame(g_sounding.note, g_sounding.n);
+                ms = g_io->now() - t0 - now;
+                telem_frame(now, ms);
+                cost = ms > cost ? ms : cost - (cost + 7UL) / 8UL;   /* jumps up, eases down */
+                last_draw = now; g_view_dirty = 0; held = 0; rate_n++;
+            }
+        }
+        next = e ? e->t : sc->len;
+        if(next > next_poll) next = next_poll;
+        if(g_tm_overlay && next > next_stat) next = next_stat;
+        g_io->wait_until(t0 + next);
+    }
+    g_late_voices = cur.late;
+    return 0;
+}
+
+/* ===== Sheet player (with B=, SUS=, OVL=); also plays .mid files ===== */
+int play_sheet_file(const char *path){
+    Score sc; unsigned ch;
+    const char *err;
+
+    /* .mid files load whole; sheets compile a window per voice ahead of playback */
+    scr_clear(); scr_puts(1,1,"Loading: "); scr_puts(10,1,path); scr_present();
+    if(!(is_midi_path(path) ? load_score(path, &sc) : sheet_stream_open(path, &sc))){ scr_clear(); scr_puts(1,2, sc.err ? sc.err : "Could not open file."); scr_present(); g_io->wait_until(g_io->now() + 1000); return 1; }
+    if(score_truncated(&sc)){ scr_puts(1,2,"Sheet too long, playing the part that fit."); scr_present(); g_io->wait_until(g_io->now() + 1000); }
+
+    /* reset runtime state for file */
+    g_tempo_bpm = 120; g_beat = BEAT_Q;
+    g_program = 0; g_sustain = 0; g_overlap_ms = 20;
+
+    /* the channels in the first windows now, any others as they first play */
+    g_ch_used = score_channels(&sc) | 1U;
+    for(ch=0; ch<16; ch++) if(g_ch_used & (1U<<ch)) channel_reset(ch);
+
+    play_timeline(&sc);
+    err = sc.err;                            /* a streamed sheet refused on a later window */
+    score_free(&sc);
+
+    for(ch=0; ch<16; ch++) if(g_ch_used & (1U<<ch)){
+        midi_all_notes_off(ch);
+        midi_cc(ch,64,0); /* pedal up */
+    }
+    mpu_flush(TX_STALL_MS);
+    scr_clear(); scr_puts(1,12,"Done. Press any key...");
+    { char buf[80]; sprintf(buf,"MIDI out: %u bytes overflowed, %u dropped, %lu saved by encoder",
+        g_tx_overflow, (unsigned)g_tx_dropped, g_enc_saved); scr_puts(1,13,buf); }
+    if(err){ scr_puts(1,14,"Stopped early: "); scr_puts(16,14,err); }
+    if(g_late_voices){
+        char buf[80]; unsigned v, n = 0;
+        for(v=0; v<MAX_VOICES; v++) if(g_late_voices & (1U<<v)) n += sprintf(buf + n, "V=%u ", v);
+        scr_puts(1,15,"Started late, name them on the first line: "); scr_puts(44,15,buf);
+    }
+    scr_present();
+    g_io->key(1);
+    return 0;
+}
+
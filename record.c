@@ -0,0 +1,248 @@
+/* Live recording: the interactive loop appends what is played (keys and
+   MIDI input) to a buffer allocated before the take starts, so recording
+   an event only stores it. Once the take is over rec_write pairs the
+   notes, snaps them to the grid and writes a .mid (everything, velocities
+   and controllers included) or a sheet (notes, chords, rests and the first
+   program per voice; velocity and pedal have no sheet syntax).
+   The take is timed at 120 bpm, a quarter every 500 ms.
+*/
+#include <stdio.h>
+#include <string.h>  /* memset */
+#include "music3.h"
+
+typedef struct {
+    unsigned long t;       /* ms from the clock; ticks from the start once rec_write ran */
+    unsigned long len;     /* note-on: ticks to its note-off */
+    unsigned char st, d1, d2;
+} RecEv;
+
+#define REC_OPEN 32        /* held notes that can be paired; the rest are dropped */
+
+static Arena g_rec_ar;
+static RecEv M3FAR *g_rec = 0;
+static unsigned g_rec_cap, g_rec_n;
+
+/* room for REC_OPEN note-offs as well, for the notes still held at the end */
+int rec_open(unsigned n){
+    rec_free();
+    if((g_rec = (RecEv M3FAR *)arena_alloc(&g_rec_ar, (n + REC_OPEN) * sizeof(RecEv))) == 0) return 0;
+    g_rec_cap = n; g_rec_n = 0;
+    return 1;
+}
+
+void rec_free(void){ arena_free(&g_rec_ar); g_rec = 0; g_rec_cap = g_rec_n = 0; }
+
+/* hot path: note on/off (no running status, velocity 0 already made an off), CC, program */
+void rec_event(unsigned long t, unsigned char status, unsigned char d1, unsigned char d2){
+    RecEv M3FAR *r;
+    if(g_rec_n == g_rec_cap){ g_tm[TM_REC_LOST]++; return; }
+    r = &g_rec[g_rec_n++];
+    r->t = t; r->st = status; r->d1 = d1; r->d2 = d2;
+}
+
+unsigned rec_count(void){ return g_rec_n; }
+
+/* ===== After the take ===== */
+/* ms at 120 bpm to ticks, rounded; split so the product never overflows */
+static unsigned long rec_ticks(unsigned long ms){ return ms / 500UL * SCORE_PPQ + ((ms % 500UL) * SCORE_PPQ + 250UL) / 500UL; }
+static unsigned long rec_snap(unsigned long t, unsigned long step){ return (t + step / 2UL) / step * step; }
+
+/* at one time: offs, then controllers and programs, then ons; dropped last */
+static unsigned rec_rank(unsigned char st){
+    switch(st & 0xF0){ case 0x80: return 0; case 0xB0: case 0xC0: return 1; case 0x90: return 2; }
+    return 3;
+}
+
+/* Shell sort: the buffer is far, so qsort cannot take it */
+static void rec_sort(unsigned n){
+    unsigned h = 1, i, j;
+    while(h < n / 3U) h = h * 3U + 1U;
+    for(; h; h /= 3U){
+        for(i = h; i < n; i++){
+            RecEv x = g_rec[i];
+            unsigned rx = rec_rank(x.st);
+            for(j = i; j >= h && (g_rec[j-h].t > x.t || (g_rec[j-h].t == x.t && rec_rank(g_rec[j-h].st) > rx)); j -= h) g_rec[j] = g_rec[j-h];
+            g_rec[j] = x;
+        }
+    }
+}
+
+/* Times become ticks from the first note (what came before it lands on
+   0); notes are paired first in first out per channel and key, snapped to
+   the grid and kept at least one step long; the notes still held get their
+   off at t_end. Returns the events. */
+static unsigned rec_prepare(unsigned long step, unsigned long t_end){
+    unsigned open[REC_OPEN], nopen = 0, i, k, n = g_rec_n;
+    unsigned long t0 = t_end;
+    for(i=0;i<n;i++) if((g_rec[i].st & 0xF0) == 0x90){ t0 = g_rec[i].t; break; }
+    for(i=0;i<n;i++){
+        RecEv M3FAR *r = &g_rec[i];
+        unsigned long t = (long)(r->t - t0) > 0 ? rec_ticks(r->t - t0) : 0UL;
+        switch(r->st & 0xF0){
+            case 0x90:
+                r->t = rec_snap(t, step); r->len = step;
+                if(nopen < REC_OPEN) open[nopen++] = i; else r->st = 0;
+                break;
+            case 0x80:
+                for(k=0;k<nopen;k++) if(g_rec[open[k]].st == (r->st | 0x10) && g_rec[open[k]].d1 == r->d1) break;
+                if(k == nopen){ r->st = 0; break; }                  /* its on was not kept */
+                r->t = rec_snap(t, step);
+                if(r->t < g_rec[open[k]].t + step) r->t = g_rec[open[k]].t + step;
+                g_rec[open[k]].len = r->t - g_rec[open[k]].t;
+                for(nopen--; k<nopen; k++) open[k] = open[k+1];
+                break;
+            default: r->t = t; break;                               /* controllers keep their time */
+        }
+    }
+    for(k=0;k<nopen;k++){
+        RecEv M3FAR *on = &g_rec[open[k]], M3FAR *r = &g_rec[n++];
+        r->t = rec_snap(rec_ticks(t_end - t0), step);
+        if(r->t < on->t + step) r->t = on->t + step;
+        on->len = r->t - on->t;
+        r->st = (unsigned char)((on->st & 0x0F) | 0x80); r->d1 = on->d1; r->d2 = 64;
+    }
+    rec_sort(n);
+    return n;
+}
+
+/* one track at SCORE_PPQ, no tempo event: 120 bpm */
+static int rec_smf(const char *path, unsigned n){
+    Score sc;
+    TempoMap tm;
+    unsigned i;
+    int ok;
+    memset(&sc, 0, sizeof(sc));
+    sc.nv = 1; sc.ppq = SCORE_PPQ;
+    for(i=0;i<n;i++){
+        const RecEv M3FAR *r = &g_rec[i];
+        unsigned char ch = (unsigned char)(r->st & 0x0F);
+        switch(r->st & 0xF0){
+            case 0x90: ev_push(&sc.v[0], r->t, EV_NOTE_ON, ch, r->d1, r->d2, 0); break;
+            case 0x80: ev_push(&sc.v[0], r->t, EV_NOTE_OFF, ch, r->d1, r->d2, 0); break;
+            case 0xB0: ev_push(&sc.v[0], r->t, EV_CC, ch, r->d1, r->d2, 0); break;
+            case 0xC0: ev_push(&sc.v[0], r->t, EV_PROG, ch, r->d1, 0, 0); break;
+            default: continue;
+        }
+        sc.ticks = r->t;
+    }
+    tempo_init(&tm, SCORE_PPQ);
+    sc.len = tempo_ms(&tm, sc.ticks);
+    ok = !sc.v[0].full && smf_write(path, &sc);
+    score_free(&sc);
+    return ok;
+}
+
+/* ===== Sheet writer ===== */
+#define REC_S (SCORE_PPQ / 4)                /* the sheet's smallest step, a sixteenth */
+static const char *const NAMES[12] = { "C","Db","D","Eb","E","F","Gb","G","Ab","A","Bb","B" };   /* '#' is a comment */
+static const struct { unsigned char n; char tok[3]; } DURS[] = {
+    {24,"w."},{16,"w"},{12,"h."},{8,"h"},{6,"q."},{4,"q"},{3,"e."},{2,"e"},{1,"s"}
+};
+
+/* the longest duration token that fits n sixteenths; a longer note is cut to it */
+static unsigned rec_dur(unsigned long n){
+    unsigned i;
+    for(i=0; i<sizeof(DURS)/sizeof(DURS[0]) - 1 && DURS[i].n > n; i++) ;
+    return i;
+}
+
+typedef struct {
+    unsigned long start, end;                /* sixteenths: the last group's start, where the voice is */
+    unsigned char ch, prog, dur, nchord;
+} RecVoice;
+
+static void rec_rests(FILE *f, unsigned long n){
+    while(n){ unsigned d = rec_dur(n); fprintf(f, " R%s", DURS[d].tok); n -= DURS[d].n; }
+}
+
+/* Notes go to the first voice of their channel that is free by their start,
+   or join its last group when they start and end with it (a chord, up to
+   8); a channel gets a new voice when none is free, up to MAX_VOICES. A
+   program change sets I= for the voices its channel opens from then on, and
+   is written inline, at its sixteenth, in those already playing. */
+static int rec_sheet(const char *path, unsigned n, unsigned grid){
+    RecVoice v[MAX_VOICES];
+    unsigned char prog[16];
+    unsigned nv = 0, i, k, notes = 0, dropped = 0;
+    FILE *f;
+    memset(prog, 0xFF, sizeof(prog));
+    for(i=0;i<n;i++){
+        RecEv M3FAR *r = &g_rec[i];
+        unsigned long s, e;
+        unsigned char ch = (unsigned char)(r->st & 0x0F), d;
+        if((r->st & 0xF0) == 0xC0){ prog[ch] = r->d1; r->t = (r->t + REC_S / 2) / REC_S; continue; }
+        if((r->st & 0xF0) != 0x90) continue;
+        r->st = 0;
+        s = (r->t + REC_S / 2) / REC_S; e = (r->t + r->len + REC_S / 2) / REC_S;
+        d = (unsigned char)rec_dur(e > s ? e - s : 1UL);
+        if(r->d1 < 12){ dropped++; continue; }                      /* below C0: no name for it */
+        for(k=0;k<nv;k++) if(v[k].ch == ch && v[k].start == s && v[k].dur == d && v[k].nchord < 8) break;
+        if(k < nv){ v[k].nchord++; }
+        else {
+            for(k=0;k<nv;k++) if(v[k].ch == ch && v[k].end <= s) break;
+            if(k == nv){
+                if(nv == MAX_VOICES){ dropped++; continue; }
+                v[nv].ch = ch; v[nv].prog = prog[ch]; nv++;
+            }
+            v[k].start = s; v[k].dur = d; v[k].end = s + DURS[d].n; v[k].nchord = 1;
+        }
+        r->st = 0x90; r->d2 = (unsigned char)k; r->t = s; r->len = d;
+        notes++;
+    }
+
+    if((f = fopen(path, "w")) == 0) return 0;
+    fprintf(f, "# Recorded take: %u notes", notes);
+    if(grid) fprintf(f, " on a 1/%u grid", grid);
+    if(dropped) fprintf(f, ", %u dropped", dropped);
+    fprintf(f, "\nT=120\n");
+    if(nv > 1){                              /* the voices follow each other: name them up front */
+        for(k=1;k<nv;k++) fprintf(f, "V=%u ", k);
+        fputc('\n', f);
+    }
+    for(k=0;k<nv;k++){
+        unsigned long pos = 0;
+        unsigned groups = 0, nm = 0;
+        unsigned char mids[8], d = 0;
+        fprintf(f, "\nV=%u CH=%u", k, (unsigned)v[k].ch);
+        if(v[k].prog != 0xFF) fprintf(f, " I=%u", (unsigned)v[k].prog);
+        fputc('\n', f);
+        for(i=0;i<=n;i++){
+            const RecEv M3FAR *r = i < n ? &g_rec[i] : 0;
+            int pc = r && r->st == (0xC0 | v[k].ch);
+            if(r && !pc && (r->st != 0x90 || r->d2 != k)) continue;
+            if(nm && (!r || pc || r->t != pos)){                   /* the group ends */
+                unsigned j;
+                if(nm == 1) fprintf(f, " %s%u%s", NAMES[mids[0] % 12], mids[0] / 12 - 1, DURS[d].tok);
+                else {
+                    fputs(" [", f);
+                    for(j=0;j<nm;j++) fprintf(f, "%s%s%u", j ? " " : "", NAMES[mids[j] % 12], mids[j] / 12 - 1);
+                    fprintf(f, "]%s", DURS[d].tok);
+                }
+                pos += DURS[d].n; nm = 0;
+                if(++groups % 12 == 0) fputc('\n', f);
+            }
+            if(!r) break;
+            if(pc){                                                 /* before the first note it is the voice's I= */
+                if(groups){ if(r->t > pos){ rec_rests(f, r->t - pos); pos = r->t; } fprintf(f, " I=%u", (unsigned)r->d1); }
+                continue;
+            }
+            if(!nm){ rec_rests(f, r->t - pos); pos = r->t; d = (unsigned char)r->len; }
+            mids[nm++] = r->d1;
+        }
+        fputc('\n', f);
+    }
+    return fclose(f) == 0;
+}
+
+/* .mid by the extension, else a sheet; grid: notes per whole (16 =
+   sixteenths), 0 leaves the .mid unquantized (a sheet has sixteenths at
+   best). Frees the buffer. */
+int rec_write(const char *path, unsigned grid, unsigned long t_end){
+    unsigned n;
+    int ok;
+    if(!g_rec) return 0;
+    n = rec_prepare(grid ? 4UL * SCORE_PPQ / grid : 1UL, t_end);
+    ok = is_midi_path(path) ? rec_smf(path, n) : rec_sheet(path, n, grid);
+    rec_free();
+    return ok;
+}
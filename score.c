@@ -0,0 +1,390 @@
+/* Compiled score storage: one time-ordered event stream per voice, and the
+   k-way merge cursor that interleaves them by timestamp at play time.
+*/
+#include <stdlib.h>  /* malloc, free */
+#include <string.h>  /* memset */
+#if defined(__WATCOMC__) && defined(__I86__)
+#include <malloc.h>  /* _fmalloc, _ffree */
+#define far_alloc(n) _fmalloc(n)
+#define far_free(p)  _ffree(p)
+#else
+#define far_alloc(n) malloc(n)
+#define far_free(p)  free(p)
+#endif
+#include "music3.h"
+
+/* ===== Far arena ===== */
+#define ARENA_BLK 4096U    /* block data size; a bigger request gets a block of its own */
+
+unsigned char M3FAR *arena_alloc(Arena *a, unsigned n){
+    ArenaBlk M3FAR *b = a->tail;
+    /* after a rewind the blocks past tail are empty and get reused first */
+    while(b && b->size - b->used < n) b = b->next;
+    if(!b){
+        unsigned size = n > ARENA_BLK ? n : ARENA_BLK;
+        if((b = (ArenaBlk M3FAR *)far_alloc(sizeof(ArenaBlk) + size)) == 0) return 0;
+        b->next = 0; b->used = 0; b->size = size;
+        if(a->tail){ while(a->tail->next) a->tail = a->tail->next; a->tail->next = b; } else a->head = b;
+        a->bytes += size;
+    }
+    a->tail = b;
+    b->used += n;
+    return (unsigned char M3FAR *)(b + 1) + (b->used - n);
+}
+
+void arena_rewind(Arena *a){
+    ArenaBlk M3FAR *b;
+    for(b = a->head; b; b = b->next) b->used = 0;
+    a->tail = a->head;
+}
+
+void arena_free(Arena *a){
+    while(a->head){ ArenaBlk M3FAR *nx = a->head->next; far_free(a->head); a->head = nx; }
+    a->tail = 0; a->bytes = 0;
+}
+
+/* ===== Tempo map ===== */
+/* floor((a*b + r) / c), remainder in *rem: the product is built from 16-bit
+   halves because the DOS build has nothing wider than 32 bits. The
+   quotient must fit 32 bits and c stay below 2^31. */
+static unsigned long mul_div(unsigned long a, unsigned long b, unsigned long r, unsigned long c, unsigned long *rem){
+    unsigned long lo = (a & 0xFFFFUL) * (b & 0xFFFFUL), m1 = (a >> 16) * (b & 0xFFFFUL), m2 = (a & 0xFFFFUL) * (b >> 16);
+    unsigned long hi = (a >> 16) * (b >> 16), mid = (lo >> 16) + (m1 & 0xFFFFUL) + (m2 & 0xFFFFUL), q = 0, rr;
+    int i;
+    lo = ((lo & 0xFFFFUL) | ((mid & 0xFFFFUL) << 16)) & 0xFFFFFFFFUL;
+    hi += (m1 >> 16) + (m2 >> 16) + (mid >> 16);
+    lo = (lo + r) & 0xFFFFFFFFUL; if(lo < r) hi++;
+    for(rr = hi % c, i = 32; i-- > 0; ){
+        rr = (rr << 1) | ((lo >> i) & 1UL); q <<= 1;
+        if(rr >= c){ rr -= c; q |= 1UL; }
+    }
+    if(rem) *rem = rr;
+    return q;
+}
+
+/* quarter = beats of each unit: Q 1, E 2, H 1/2, W 1/4, S 4, DQ 2/3 */
+static const unsigned char QNUM[] = { 1, 2, 1, 1, 4, 2 }, QDEN[] = { 1, 1, 2, 4, 1, 3 };
+
+void tempo_init(TempoMap *m, unsigned ppq){
+    m->tick0 = m->ms0 = m->rem0 = 0;
+    m->ppq = ppq ? ppq : SCORE_PPQ;
+    m->num = 60000UL; m->div = 120UL * m->ppq;
+}
+
+void tempo_set(TempoMap *m, unsigned long tick, const Event *e){
+    unsigned long num, div, rr;
+    if(e->d1 == BEAT_US){ num = tempo_us(e) ? tempo_us(e) : 500000UL; div = 1000UL * m->ppq; }
+    else {
+        unsigned b = e->d1 <= BEAT_DQ ? e->d1 : BEAT_Q;
+        num = 60000UL * QNUM[b]; div = (unsigned long)(e->w ? e->w : 120U) * QDEN[b] * m->ppq;
+    }
+    if(tick > m->tick0){
+        m->ms0 += mul_div(tick - m->tick0, m->num, m->rem0, m->div, &rr);
+        m->rem0 = mul_div(rr, div, 0, m->div, 0);     /* the part of a ms, now in the new unit */
+        m->tick0 = tick;
+    }
+    else m->rem0 = mul_div(m->rem0, div, 0, m->div, 0);
+    m->num = num; m->div = div;
+}
+
+/* to the nearest ms: a .mid tempo in whole us lands within a hair of it */
+unsigned long tempo_ms(const TempoMap *m, unsigned long tick){
+    return m->ms0 + mul_div(tick > m->tick0 ? tick - m->tick0 : 0UL, m->num, m->rem0 + m->div / 2UL, m->div, 0);
+}
+
+unsigned long tempo_ticks(const TempoMap *m, unsigned long ms){ return mul_div(ms, m->div, m->num - 1UL, m->num, 0); }
+
+unsigned long tempo_us(const Event *e){
+    unsigned b, bpm;
+    if(e->d1 == BEAT_US) return ((unsigned long)e->d2 << 16) | e->w;
+    b = e->d1 <= BEAT_DQ ? e->d1 : BEAT_Q; bpm = e->w ? e->w : 120U;
+    return (60000000UL * QNUM[b] + (unsigned long)bpm * QDEN[b] / 2UL) / ((unsigned long)bpm * QDEN[b]);
+}
+
+/* ===== Packed event records ===== */
+/* One record per event, never split across blocks:
+     head    bit 7: same time as the previous record, bits 6-4: kind, 3-0: channel
+     [delta] ticks since the previous record, 7 bits a byte, high bit = more follows
+     note on/off: note, bit 7 set when a velocity byte follows (else the last one)
+     cc: controller, value   program: program   overlap: varint ms
+     others (tempo, call): d1, d2, varint w */
+#define EV_REC_MAX 16
+
+static unsigned put_varint(unsigned char *p, unsigned long v){
+    unsigned char tmp[5]; unsigned n = 0, k = 0;
+    do { tmp[n++] = (unsigned char)(v & 0x7F); v >>= 7; } while(v);
+    while(n--) p[k++] = (unsigned char)(tmp[n] | (n ? 0x80 : 0));
+    return k;
+}
+
+void ev_push(EvBuf *b, unsigned long t, unsigned char kind, unsigned char ch, unsigned char d1, unsigned char d2, unsigned w){
+    unsigned char r[EV_REC_MAX], M3FAR *p;
+    unsigned n = 1, i;
+    if(b->full) return;
+    if(t < b->last_t) t = b->last_t;        /* a voice is time-ordered; late merges play at once */
+    r[0] = (unsigned char)(((kind & 7) << 4) | (ch & 0x0F));
+    if(t == b->last_t && b->n) r[0] |= 0x80; else n += put_varint(r + n, t - b->last_t);
+    switch(kind){
+        case EV_NOTE_ON:
+            r[n++] = (unsigned char)(d1 & 0x7F);
+            if(d2 != b->vel_on){ r[n-1] |= 0x80; r[n++] = d2; }
+            break;
+        case EV_NOTE_OFF:
+            r[n++] = (unsigned char)(d1 & 0x7F);
+            if(d2 != b->vel_off){ r[n-1] |= 0x80; r[n++] = d2; }
+            break;
+        case EV_CC:    r[n++] = d1; r[n++] = d2; break;
+        case EV_PROG:  r[n++] = d1; break;
+        case EV_OVL:   n += put_varint(r + n, w); break;
+        default:       r[n++] = d1; r[n++] = d2; n += put_varint(r + n, w); break;
+    }
+    if((p = arena_alloc(&b->ar, n)) == 0){ b->full = 1; return; }
+    for(i=0;i<n;i++) p[i] = r[i];
+    if(kind == EV_NOTE_ON) b->vel_on = d2; else if(kind == EV_NOTE_OFF) b->vel_off = d2;
+    b->last_t = t; b->n++;
+}
+
+/* empty the buffer but keep its blocks (a streamed window being refilled) */
+void evbuf_clear(EvBuf *b){ arena_rewind(&b->ar); b->n = 0; b->last_t = 0; b->vel_on = b->vel_off = 0; b->full = 0; }
+
+void evbuf_free(EvBuf *b){ arena_free(&b->ar); b->n = 0; b->last_t = 0; b->vel_on = b->vel_off = 0; b->full = 0; }
+
+void ev_reader_init(EvReader *r, const EvBuf *b){
+    r->blk = b->ar.head; r->off = 0; r->left = b->n; r->t = 0; r->vel_on = r->vel_off = 0;
+}
+
+static unsigned char rd_byte(EvReader *r){
+    while(r->off >= r->blk->used){ r->blk = r->blk->next; r->off = 0; }
+    return ((const unsigned char M3FAR *)(r->blk + 1))[r->off++];
+}
+static unsigned long rd_varint(EvReader *r){
+    unsigned long v = 0; unsigned char c;
+    do { c = rd_byte(r); v = (v << 7) | (c & 0x7F); } while(c & 0x80);
+    return v;
+}
+
+int ev_read(EvReader *r, Event *e){
+    unsigned char h;
+    if(!r->left) return 0;
+    r->left--;
+    h = rd_byte(r);
+    if(!(h & 0x80)) r->t += rd_varint(r);
+    e->t = r->t; e->kind = (unsigned char)((h >> 4) & 7); e->ch = (unsigned char)(h & 0x0F);
+    e->d1 = e->d2 = 0; e->w = 0;
+    switch(e->kind){
+        case EV_NOTE_ON:
+            e->d1 = rd_byte(r);
+            if(e->d1 & 0x80){ e->d1 &= 0x7F; r->vel_on = rd_byte(r); }
+            e->d2 = r->vel_on;
+            break;
+        case EV_NOTE_OFF:
+            e->d1 = rd_byte(r);
+            if(e->d1 & 0x80){ e->d1 &= 0x7F; r->vel_off = rd_byte(r); }
+            e->d2 = r->vel_off;
+            break;
+        case EV_CC:    e->d1 = rd_byte(r); e->d2 = rd_byte(r); break;
+        case EV_PROG:  e->d1 = rd_byte(r); break;
+        case EV_OVL:   e->w = (unsigned short)rd_varint(r); break;
+        default:       e->d1 = rd_byte(r); e->d2 = rd_byte(r); e->w = (unsigned short)rd_varint(r); break;
+    }
+    return 1;
+}
+
+void score_free(Score *s){
+    unsigned v;
+    if(s->release) s->release(s);
+    for(v=0; v<MAX_VOICES; v++) evbuf_free(&s->v[v]);
+    if(s->pat){ for(v=0; v<s->npat; v++) evbuf_free(&s->pat[v].ev); free(s->pat); }
+    s->nv = 0; s->len = 0; s->ticks = 0; s->pat = 0; s->npat = s->pat_cap = 0; s->refill = 0; s->release = 0; s->src = 0;
+}
+
+/* a new, empty pattern; the table doubles when it is full. -1 once it
+   holds PAT_MAX, or if there is no memory to grow it */
+int score_pattern_new(Score *s){
+    if(s->npat == s->pat_cap){
+        unsigned cap = s->pat_cap ? s->pat_cap * 2U : 8U;
+        Pattern *p;
+        if(cap > PAT_MAX) cap = PAT_MAX;
+        if(cap == s->pat_cap || (p = (Pattern*)realloc(s->pat, cap * sizeof(Pattern))) == 0) return -1;
+        s->pat = p; s->pat_cap = cap;
+    }
+    memset(&s->pat[s->npat], 0, sizeof(Pattern));
+    return (int)s->npat++;
+}
+
+/* events stored, patterns counted once however often they play */
+unsigned long score_events(const Score *s){
+    unsigned v; unsigned long n = 0;
+    for(v=0; v<s->nv; v++) n += s->v[v].n;
+    for(v=0; v<s->npat; v++) n += s->pat[v].ev.n;
+    return n;
+}
+
+/* far memory the events take */
+unsigned long score_bytes(const Score *s){
+    unsigned v; unsigned long n = 0;
+    for(v=0; v<MAX_VOICES; v++) n += s->v[v].ar.bytes;
+    for(v=0; v<s->npat; v++) n += s->pat[v].ev.ar.bytes;
+    return n;
+}
+
+int score_truncated(const Score *s){
+    unsigned v;
+    for(v=0; v<s->nv; v++) if(s->v[v].full) return 1;
+    for(v=0; v<s->npat; v++) if(s->pat[v].ev.full) return 1;
+    return 0;
+}
+
+/* bit per MIDI channel any voice plays on (a streamed score: its current windows) */
+unsigned score_channels(const Score *s){
+    unsigned v, mask = 0;
+    EvReader r; Event e;
+    for(v=0; v<s->nv; v++) for(ev_reader_init(&r, &s->v[v]); ev_read(&r, &e); ) if(e.kind <= EV_PROG || e.kind == EV_CALL) mask |= 1U << (e.ch & 0x0F);
+    return mask;
+}
+
+/* ===== k-way merge: a binary min-heap of voices keyed by their next event ===== */
+static const Event *head_of(const ScoreCursor *c, unsigned v){ return &c->ev[v]; }
+
+/* earlier time first; on a tie the lower voice goes first, so merges are stable */
+static int voice_before(const ScoreCursor *c, unsigned a, unsigned b){
+    unsigned long ta = head_of(c, a)->t, tb = head_of(c, b)->t;
+    return ta < tb || (ta == tb && a < b);
+}
+
+static void sift_down(ScoreCursor *c, unsigned i){
+    for(;;){
+        unsigned l = 2*i + 1, r = l + 1, m = i;
+        unsigned char tmp;
+        if(l < c->nheap && voice_before(c, c->heap[l], c->heap[m])) m = l;
+        if(r < c->nheap && voice_before(c, c->heap[r], c->heap[m])) m = r;
+        if(m == i) return;
+        tmp = c->heap[i]; c->heap[i] = c->heap[m]; c->heap[m] = tmp;
+        i = m;
+    }
+}
+
+/* Next playable event of voice v into c->ev[v]; 0 once the voice is done.
+   A call pushes a frame, and a frame that runs out either starts its next
+   pass or pops back to the caller. Calls nest up to PAT_DEPTH (the sheet
+   compiler writes a deeper call out in place, so none is skipped); a
+   pattern only calls ones that were complete before it, so nothing
+   recurses. This is the one place ticks turn into ms, on the voice's
+   tempo map. */
+static int voice_next(ScoreCursor *c, unsigned v){
+    Event *e = &c->ev[v];
+    for(;;){
+        CursorFrame *f = &c->fr[v][c->depth[v] - 1];
+        if(!ev_read(&f->rd, e)){
+            if(c->depth[v] > 1){
+                if(f->reps){ f->reps--; f->base += c->sc->pat[f->pat].len; ev_reader_init(&f->rd, &c->sc->pat[f->pat].ev); }
+                else c->depth[v]--;
+                continue;
+            }
+            /* window played out: a streamed voice parses its next one */
+            if(c->sc->refill && c->sc->refill(c->sc, v)){ ev_reader_init(&f->rd, &c->sc->v[v]); continue; }
+            return 0;
+        }
+        e->t += f->base;
+        if(c->depth[v] > 1){
+            e->ch = f->ch;
+            if(e->kind == EV_NOTE_ON || e->kind == EV_NOTE_OFF){
+                int n = (int)e->d1 + f->tr;
+                e->d1 = (unsigned char)(n < 0 ? 0 : n > 127 ? 127 : n);
+            }
+        }
+        if(e->kind == EV_TEMPO) tempo_set(&c->tm[v], e->t, e);
+        if(e->kind != EV_CALL){ c->tick[v] = e->t; e->t = tempo_ms(&c->tm[v], e->t); return 1; }
+        if(e->d1 < c->sc->npat && c->sc->pat[e->d1].done && e->w && c->depth[v] < PAT_DEPTH){
+            CursorFrame *g = &c->fr[v][c->depth[v]++];
+            int tr = f->tr + (signed char)e->d2;
+            ev_reader_init(&g->rd, &c->sc->pat[e->d1].ev);
+            g->base = e->t; g->reps = e->w - 1U; g->pat = e->d1; g->ch = e->ch;
+            g->tr = (signed char)(tr < -127 ? -127 : tr > 127 ? 127 : tr);
+        }
+    }
+}
+
+static void sift_up(ScoreCursor *c, unsigned i){
+    while(i && voice_before(c, c->heap[i], c->heap[(i-1)/2])){
+        unsigned char tmp = c->heap[i];
+        c->heap[i] = c->heap[(i-1)/2]; c->heap[(i-1)/2] = tmp;
+        i = (i-1)/2;
+    }
+}
+
+/* Voices a streamed score met while its windows were read: each starts
+   from its own beginning, and goes into the heap at its first event (late
+   if that is before what already played). Opening one reads the file on,
+   which can meet more. */
+static void open_met(ScoreCursor *c){
+    unsigned v, more;
+    while((more = c->sc->met & c->mask & ~c->open) != 0){
+        for(v=0; !(more & (1U << v)); v++) ;
+        c->open |= 1U << v;
+        ev_reader_init(&c->fr[v][0].rd, &c->sc->v[v]);
+        if(!voice_next(c, v)) continue;
+        if(c->ev[v].t < c->played) c->late |= 1U << v;
+        c->heap[c->nheap] = (unsigned char)v; sift_up(c, c->nheap++);
+    }
+}
+
+void score_cursor_voices(ScoreCursor *c, Score *sc, unsigned mask){
+    unsigned v, i;
+    c->sc = sc; c->nheap = 0; c->mask = mask; c->open = 0; c->late = 0; c->played = 0;
+    for(v=0; v<MAX_VOICES; v++){
+        CursorFrame *f = &c->fr[v][0];
+        ev_reader_init(&f->rd, &sc->v[v]);
+        f->base = 0; f->reps = 0; f->tr = 0; f->pat = 0; f->ch = 0;
+        c->depth[v] = 1;
+        tempo_init(&c->tm[v], sc->ppq);
+        if(sc->refill && !(sc->met & (1U << v))) continue;     /* not reached yet */
+        c->open |= 1U << v;
+        if(v < sc->nv && (mask & (1U << v)) && voice_next(c, v)) c->heap[c->nheap++] = (unsigned char)v;
+    }
+    for(i = c->nheap/2; i-- > 0; ) sift_down(c, i);
+    if(sc->refill) open_met(c);
+}
+
+void score_cursor_init(ScoreCursor *c, Score *sc){ score_cursor_voices(c, sc, ~0U); }
+
+const Event *score_cursor_peek(const ScoreCursor *c){ return c->nheap ? head_of(c, c->heap[0]) : 0; }
+
+/* voice the event score_cursor_peek returns belongs to */
+unsigned score_cursor_voice(const ScoreCursor *c){ return c->heap[0]; }
+
+unsigned long score_cursor_tick(const ScoreCursor *c){ return c->tick[c->heap[0]]; }
+
+void score_cursor_next(ScoreCursor *c){
+    if(!c->nheap) return;
+    c->played = head_of(c, c->heap[0])->t;
+    if(!voice_next(c, c->heap[0])) c->heap[0] = c->heap[--c->nheap];
+    sift_down(c, 0);
+    if(c->sc->refill) open_met(c);
+}
+
+/* ===== Sounding notes ===== */
+/* A second note-on for a sounding note (two voices on one channel,
+   overlapping notes in a .mid) is not sent again, and only the last
+   note-off goes out, so one voice never cuts another short. A note that
+   finds the table full is sent untracked. */
+static int sounding_find(const Sounding *s, unsigned ch, unsigned note){
+    int i;
+    for(i=0;i<s->n;i++) if(s->note[i]==note && s->ch[i]==ch) return i;
+    return -1;
+}
+
+int sounding_on(Sounding *s, unsigned ch, unsigned note){
+    int i;
+    if((i = sounding_find(s, ch, note)) >= 0){ if(s->cnt[i] < 255) s->cnt[i]++; return 0; }
+    if(s->n < MAX_ACTIVE){ s->note[s->n] = (unsigned char)note; s->ch[s->n] = (unsigned char)ch; s->cnt[s->n] = 1; s->n++; }
+    return 1;
+}
+
+int sounding_off(Sounding *s, unsigned ch, unsigned note){
+    int i;
+    if((i = sounding_find(s, ch, note)) < 0) return 1;
+    if(--s->cnt[i]) return 0;
+    s->n--; s->note[i] = s->note[s->n]; s->ch[i] = s->ch[s->n]; s->cnt[i] = s->cnt[s->n];
+    return 1;
+}
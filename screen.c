@@ -0,0 +1,103 @@
+/* Text renderer and ASCII oscilloscope.
+   Frames are built off-screen; scr_present hands only the changed cells to
+   the backend (straight into text VRAM on DOS).
+*/
+#include <string.h>  /* memset, memcmp */
+#include "music3.h"
+
+/* ===== Text renderer: frames are built off-screen, only changed cells are written ===== */
+#define SCR_ATTR 0x0700                  /* light grey on black, already in the high byte */
+static unsigned short g_scr[SCR_W*SCR_H];    /* frame being built */
+static unsigned short g_shown[SCR_W*SCR_H];  /* what the display currently holds */
+
+void scr_init(void){
+    g_io->scr_open();
+    memset(g_shown, 0xFF, sizeof(g_shown));  /* no cell matches: first present writes all */
+}
+void scr_done(int row){ g_io->scr_close(row); }
+
+void scr_clear(void){ int i; for(i=0;i<SCR_W*SCR_H;i++) g_scr[i] = SCR_ATTR | ' '; }
+/* 1-based like gotoxy; clipped to the screen */
+void scr_putc(int x, int y, char ch){
+    if(x<1 || x>SCR_W || y<1 || y>SCR_H) return;
+    g_scr[(y-1)*SCR_W + (x-1)] = SCR_ATTR | (unsigned char)ch;
+}
+void scr_puts(int x, int y, const char *s){ while(*s) scr_putc(x++, y, *s++); }
+
+/* Write the cells that differ from the last frame; returns how many changed */
+unsigned scr_present(void){
+    unsigned i, n = 0;
+    for(i=0;i<SCR_W*SCR_H;i++){
+        if(g_scr[i] != g_shown[i]){ g_shown[i] = g_scr[i]; g_io->scr_cell(i, g_scr[i]); n++; }
+    }
+    return n;
+}
+
+/* ===== Visual (ASCII oscilloscope, additive) ===== */
+/* Every sounding note is its own sine; the trace is their sum. Phases are
+   16-bit fixed point (65536 = one cycle) and one column is 1/SCOPE_HZ s. */
+static const signed char SINE[128] = {
+   0,  5, 10, 15, 20, 24, 29, 33, 37, 41, 45, 48, 52, 55, 58, 61,
+  64, 66, 69, 71, 73, 75, 76, 78, 79, 80, 81, 82, 82, 83, 83, 83,
+  83, 83, 82, 82, 81, 80, 79, 78, 76, 75, 73, 71, 69, 66, 64, 61,
+  58, 55, 52, 48, 45, 41, 37, 33, 29, 24, 20, 15, 10,  5,  0, -5,
+ -10,-15,-20,-24,-29,-33,-37,-41,-45,-48,-52,-55,-58,-61,-64,-66,
+ -69,-71,-73,-75,-76,-78,-79,-80,-81,-82,-82,-83,-83,-83,-83,-83,
+ -82,-82,-81,-80,-79,-78,-76,-75,-73,-71,-69,-66,-64,-61,-58,-55,
+ -52,-48,-45,-41,-37,-33,-29,-24,-20,-15,-10,-5
+};
+#define SCOPE_HZ 5000                    /* 80 columns = 16 ms: C4 shows about 4 cycles */
+/* phase step per column for each MIDI note: 440*2^((n-69)/12) * 65536 / SCOPE_HZ, mod 65536 */
+static const unsigned short NOTE_STEP[128] = {
+    107,  114,  120,  127,  135,  143,  152,  161,  170,  180,  191,  202,
+    214,  227,  241,  255,  270,  286,  303,  321,  340,  360,  382,  405,
+    429,  454,  481,  510,  540,  572,  606,  642,  680,  721,  764,  809,
+    857,  908,  962, 1020, 1080, 1144, 1212, 1284, 1361, 1442, 1528, 1618,
+   1715, 1817, 1925, 2039, 2160, 2289, 2425, 2569, 2722, 2884, 3055, 3237,
+   3429, 3633, 3849, 4078, 4320, 4577, 4850, 5138, 5443, 5767, 6110, 6473,
+   6858, 7266, 7698, 8156, 8641, 9155, 9699,10276,10887,11534,12220,12947,
+  13717,14532,15396,16312,17282,18310,19398,20552,21774,23069,24440,25894,
+  27433,29065,30793,32624,34564,36619,38797,41104,43548,46137,48881,51787,
+  54867,58129,61586,65248, 3592, 7702,12057,16671,21560,26739,32226,38039,
+  44198,50723,57636,64960, 7184,15405,24115,33343
+};
+/* rows per sine unit (Q8) for n notes: one note peaks 10 rows off the middle,
+   n notes are scaled by 1/sqrt(n) so a chord keeps its shape but stays on
+   screen; sum*gain stays inside 16 bits for every n */
+#define SCOPE_MAX 16
+static const unsigned char SCOPE_GAIN[SCOPE_MAX+1] = { 0, 31, 22, 18, 15, 14, 13, 12, 11, 10, 10, 9, 9, 9, 8, 8, 8 };
+#define SW 80
+#define SH 24
+#define SCOPE_MID 12
+
+/* Phases restart at 0 every frame, so the trace only changes with the
+   notes: it is recomputed then and replotted from g_scope_ofs otherwise */
+static unsigned char g_scope_notes[SCOPE_MAX];
+static int g_scope_n = -1;
+static unsigned g_scope_ofs[SW];         /* g_scr index of the '*' in each column */
+
+/* One pass over the columns: sum the notes' samples, scale once, plot */
+static void scope_build(const unsigned char *notes, int n){
+    unsigned short phase[SCOPE_MAX], step[SCOPE_MAX];
+    int i, x;
+    for(i=0;i<n;i++){ phase[i] = 0; step[i] = NOTE_STEP[notes[i] & 0x7F]; g_scope_notes[i] = notes[i]; }
+    g_scope_n = n;
+    for(x=0;x<SW;x++){
+        int acc = 0, y;
+        for(i=0;i<n;i++){ acc += SINE[phase[i] >> 9]; phase[i] += step[i]; }
+        /* +0x4000 keeps the shift on a non-negative value; |acc*gain| < 0x4000 */
+        y = n ? SCOPE_MID + 64 - ((acc * SCOPE_GAIN[n] + 0x4000) >> 8) : SCOPE_MID;
+        if(y<1) y=1;
+        if(y>SH) y=SH;
+        g_scope_ofs[x] = (unsigned)((y-1)*SCR_W + x);
+    }
+}
+
+void draw_scope(const unsigned char *notes, int n){
+    int x;
+    if(n < 0) n = 0;
+    if(n > SCOPE_MAX) n = SCOPE_MAX;
+    if(n != g_scope_n || memcmp(notes, g_scope_notes, (unsigned)n) != 0) scope_build(notes, n);
+    if(n == 0){ for(x=0;x<SW;x++) g_scr[g_scope_ofs[x]] = SCR_ATTR | '-'; return; }
+    for(x=0;x<SW;x++) g_scr[g_scope_ofs[x]] = SCR_ATTR | '*';
+}
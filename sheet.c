@@ -0,0 +1,691 @@
+/* Sheet compiler: tokenizes a .txt score into the event timeline.
+   Tokenizing, tempo math and durations all happen here, either up front
+   (compile_sheet) or a window ahead of the player (sheet_stream_open).
+*/
+#include <stdio.h>
+#include <stdlib.h>  /* malloc, free */
+#include <string.h>  /* memset, memmove, strchr */
+#include <ctype.h>   /* isspace, isdigit, tolower, toupper */
+#include "music3.h"
+
+/* ===== Streaming lexer ===== */
+/* Reads the sheet in blocks and drops comments as the bytes come in, so a
+   line can be any length and nothing is rescanned. Each compile step only
+   needs LEX_LOOK bytes in front of it. */
+#define LEX_BLOCK 512
+#define LEX_LOOK  32
+typedef struct {
+    FILE *f;
+    long pos;                                /* offset of the next block: lexers can share f */
+    char buf[LEX_BLOCK + LEX_LOOK + 1];      /* NUL after the valid bytes */
+    unsigned i, n;
+    unsigned char in_cmt, eof;
+} Lexer;
+
+static void lex_open(Lexer *lx, FILE *f, long pos){
+    lx->f = f; lx->pos = pos; lx->i = lx->n = 0; lx->in_cmt = 0; lx->eof = 0; lx->buf[0] = 0;
+}
+
+/* top the window up to LEX_LOOK bytes; returns the current position */
+static const char *lex_fill(Lexer *lx){
+    while(lx->n - lx->i < LEX_LOOK && !lx->eof){
+        unsigned got, k, n;
+        if(lx->i){ memmove(lx->buf, lx->buf + lx->i, lx->n - lx->i); lx->n -= lx->i; lx->i = 0; }
+        if(ftell(lx->f) != lx->pos) fseek(lx->f, lx->pos, SEEK_SET);   /* another lexer moved it */
+        got = (unsigned)fread(lx->buf + lx->n, 1, sizeof(lx->buf) - 1 - lx->n, lx->f);
+        lx->pos = ftell(lx->f);
+        if(got == 0) lx->eof = 1;
+        /* '#' and ';' comment out the rest of the line (so C# is a comment, as it always was) */
+        for(k = n = lx->n; k < lx->n + got; k++){
+            char ch = lx->buf[k];
+            if(lx->in_cmt){ if(ch != '\n') continue; lx->in_cmt = 0; }
+            else if(ch == '#' || ch == ';'){ lx->in_cmt = 1; continue; }
+            lx->buf[n++] = ch ? ch : ' ';
+        }
+        lx->n = n;
+    }
+    lx->buf[lx->n] = 0;
+    return lx->buf + lx->i;
+}
+
+/* ===== Tempo / beat-unit state ===== */
+/* An event that belongs later than the cursor: note-offs running into the
+   next note by the grace overlap, pedal changes under SUS=ON */
+#define PEND_MAX 16
+typedef struct { unsigned long t; unsigned char kind, ch, d1, d2; } Pending;
+
+/* Parser state: only lives while a sheet is being compiled */
+typedef struct {
+    unsigned tempo_bpm;                      /* T=... */
+    beat_t beat;                             /* B=... */
+    TempoMap tm;                             /* what the player will make of the ticks */
+    unsigned sustain;                        /* SUS=ON|OFF */
+    unsigned overlap_ms;                     /* OVL=... */
+    unsigned long t;                         /* compile cursor, ticks from sheet start */
+    unsigned char ch;                        /* CH=..., defaults to the voice number */
+    unsigned char held;                      /* a note went down since the pedal did */
+    unsigned char npend;
+    Pending pend[PEND_MAX];                  /* by time; equal times in the order queued */
+} SheetState;
+
+/* An open |: repeat :| or P=name { definition }: its events go into a
+   pattern, with times from where it started. Its note-offs and pedal
+   changes are worked out there too, once: a call plays them as they were,
+   whatever the caller's tempo (for OVL=) and SUS= are. Once the table
+   holds PAT_MAX (or cannot grow) a repeat is staged instead and written
+   out in place, all of its passes; a definition then, or nesting deeper
+   than BODY_MAX, refuses the sheet. */
+#define BODY_MAX 8
+static const char ERR_PATTERNS[] = "more than 256 patterns, or no memory for one";
+static const char ERR_NESTING[] = "repeats and patterns nested more than 8 deep";
+typedef struct {
+    int pat;                                 /* -1: a repeat without a pattern, staged */
+    EvBuf stage;                             /* its events until :| */
+    unsigned char def;
+    unsigned char fill;                      /* the pattern is not complete yet: its events go into it */
+    unsigned long t0;
+    SheetState saved;                        /* the voice as it was: a definition puts it back, a repeat its tempo */
+} Body;
+
+/* One SheetState per voice; V=n switches which one the tokens go to */
+typedef struct {
+    Score *out;
+    EvBuf *dst;                              /* per voice: out->v, or a stream's staging */
+    SheetState v[MAX_VOICES];
+    unsigned char used[MAX_VOICES];
+    unsigned cur;
+    unsigned char mids[8];                   /* chord being read */
+    int nmids;
+    unsigned char in_chord, skipping;        /* a chord or unknown token runs past the window */
+    Body body[BODY_MAX];
+    unsigned depth;
+    const char *err;                         /* the sheet is refused: compiling stops */
+} SheetCompiler;
+
+static void sheet_state_reset(SheetState *s){
+    s->tempo_bpm = 120; s->beat = BEAT_Q; tempo_init(&s->tm, SCORE_PPQ);
+    s->sustain = 0; s->overlap_ms = 20; s->t = 0; s->ch = 0;
+    s->held = 0; s->npend = 0;
+}
+
+/* ===== Shared parser helpers ===== */
+static const char* skip_ws(const char *p){ while(*p && isspace(*p)) ++p; return p; }
+static const char* skip_blank(const char *p){ while(*p && *p!='\n' && isspace(*p)) ++p; return p; }
+
+/* Parse NoteName[#|b]Octave -> MIDI (C4=60). *adv gets consumed chars. -1 on fail */
+static int note_from_name(const char *p, int *adv){
+    int i=0, sem=0, oct=4, midi=-1; char c = toupper(p[i]);
+    if(c<'A'||c>'G') return -1;
+    switch(c){ case 'C': sem=0; break; case 'D': sem=2; break; case 'E': sem=4; break;
+               case 'F': sem=5; break; case 'G': sem=7; break; case 'A': sem=9; break; case 'B': sem=11; break; }
+    i++;
+    if(p[i]=='#'){ sem++; i++; } else if(p[i]=='b'||p[i]=='B'){ sem--; i++; }
+    if(!isdigit(p[i])) return -1;
+    oct=0; while(isdigit(p[i])){ oct = oct*10 + (p[i]-'0'); i++; }
+    midi = 12*(oct+1) + sem; /* C-1=0 → C4=60 */
+    if(adv) *adv = i;
+    return midi;
+}
+
+/* Duration in ticks from token letter (w,h,q,e,s) and dotted flag; tempo
+   and beat unit only come in when the player turns ticks into ms */
+static unsigned long dur_ticks(char d, int dotted){
+    unsigned long num=1, den=1;
+    switch(d){
+        case 'w': num=4; den=1; break;   /* 4 quarters  */
+        case 'h': num=2; den=1; break;   /* 2 quarters  */
+        case 'q': num=1; den=1; break;   /* 1 quarter   */
+        case 'e': num=1; den=2; break;   /* 1/2 quarter */
+        case 's': num=1; den=4; break;   /* 1/4 quarter */
+        default : num=1; den=1; break;
+    }
+    { unsigned long t = (SCORE_PPQ * num) / den; if(dotted) t = (t*3UL)/2UL; return t; }
+}
+
+/* Event for the innermost open body, else for the current voice */
+static void put_at(SheetCompiler *c, unsigned long t, unsigned char kind, unsigned char ch, unsigned char d1, unsigned char d2, unsigned w){
+    if(c->depth){
+        Body *b = &c->body[c->depth - 1];
+        if(b->pat < 0) ev_push(&b->stage, t - b->t0, kind, ch, d1, d2, w);
+        else if(b->fill) ev_push(&c->out->pat[b->pat].ev, t - b->t0, kind, ch, d1, d2, w);
+        return;
+    }
+    ev_push(&c->dst[c->cur], t, kind, ch, d1, d2, w);
+}
+
+/* the pattern the events at the cursor end up in (a staged repeat is
+   written out into the one around it), 0 for the voice */
+static Pattern *host_pattern(SheetCompiler *c){
+    unsigned i;
+    for(i = c->depth; i-- > 0; ) if(c->body[i].pat >= 0) return &c->out->pat[c->body[i].pat];
+    return 0;
+}
+
+static void drop_pending(SheetState *s, unsigned i){
+    memmove(&s->pend[i], &s->pend[i+1], (s->npend - i - 1) * sizeof(Pending));
+    s->npend--;
+}
+
+/* deferred events due by t go out first, so the stream stays in time order */
+static void flush_pending(SheetCompiler *c, unsigned long t){
+    SheetState *s = &c->v[c->cur];
+    while(s->npend && s->pend[0].t <= t){
+        Pending *p = &s->pend[0];
+        put_at(c, p->t, p->kind, p->ch, p->d1, p->d2, 0);
+        drop_pending(s, 0);
+    }
+}
+
+/* queue an event for time t (> cursor); when the queue is full the oldest
+   one goes out now, which only cuts its overlap short */
+static void defer(SheetCompiler *c, unsigned long t, unsigned char kind, unsigned char d1, unsigned char d2){
+    SheetState *s = &c->v[c->cur];
+    unsigned i;
+    if(s->npend == PEND_MAX){ Pending *p = &s->pend[0]; put_at(c, s->t, p->kind, p->ch, p->d1, p->d2, 0); drop_pending(s, 0); }
+    for(i = s->npend; i > 0 && s->pend[i-1].t > t; i--) s->pend[i] = s->pend[i-1];
+    s->pend[i].t = t; s->pend[i].kind = kind; s->pend[i].ch = s->ch; s->pend[i].d1 = d1; s->pend[i].d2 = d2;
+    s->npend++;
+}
+
+/* Event at the current voice's cursor */
+static void put(SheetCompiler *c, unsigned char kind, unsigned char d1, unsigned char d2, unsigned w){
+    SheetState *s = &c->v[c->cur];
+    flush_pending(c, s->t);
+    put_at(c, s->t, kind, s->ch, d1, d2, w);
+}
+
+/* Note (or chord) of dur ticks at the cursor. The next item starts after
+   dur; the note-offs are deferred by the grace overlap, so the notes really
+   overlap it. Under sustain the keys go up on time and the pedal is changed
+   (up, down) once the new notes have sounded for the overlap, which clears
+   whatever the pedal was holding from before. OVL= is in ms: it is turned
+   into ticks at the tempo of the note. */
+static void emit_notes(SheetCompiler *c, const unsigned char *notes, int count, unsigned long dur){
+    SheetState *s = &c->v[c->cur];
+    unsigned long off = s->t + dur, ovl = tempo_ticks(&s->tm, s->overlap_ms);
+    unsigned j;
+    int i;
+    flush_pending(c, s->t);
+    for(i=0;i<count;i++){
+        /* struck again while still ringing: its old note-off would cut the new one */
+        for(j=0;j<s->npend;j++) if(s->pend[j].kind==EV_NOTE_OFF && s->pend[j].ch==s->ch && s->pend[j].d1==(unsigned char)notes[i]){
+            put_at(c, s->t, EV_NOTE_OFF, s->ch, s->pend[j].d1, s->pend[j].d2, 0); drop_pending(s, j); break;
+        }
+        put(c, EV_NOTE_ON, (unsigned char)notes[i], 100, 0);
+    }
+    if(s->sustain){
+        if(s->held){
+            unsigned long chg = s->t + (ovl < dur ? ovl : dur / 2UL);   /* before these keys go up */
+            defer(c, chg, EV_CC, 64, 0); defer(c, chg, EV_CC, 64, 127);
+        }
+        s->held = 1;
+    }
+    else off += ovl;
+    for(i=0;i<count;i++) defer(c, off, EV_NOTE_OFF, (unsigned char)notes[i], 64);
+    s->t += dur;
+}
+
+/* T= or B=: a new tempo map segment for the current voice from its cursor */
+static void set_tempo(SheetCompiler *c){
+    SheetState *s = &c->v[c->cur];
+    Event e;
+    e.kind = EV_TEMPO; e.d1 = (unsigned char)s->beat; e.d2 = 0; e.w = (unsigned short)s->tempo_bpm;
+    tempo_set(&s->tm, s->t, &e);
+    put(c, EV_TEMPO, (unsigned char)s->beat, 0, s->tempo_bpm);
+    { Pattern *host = host_pattern(c); if(host) host->tempo = 1; }
+}
+
+/* ===== Repeats and patterns ===== */
+/* Pattern edges cut the overlap: what is due by the cursor goes out on
+   time, whatever is deferred past it goes out at the cursor, so a pattern
+   holds all of its own events and nothing from around it spills in
+   between its passes */
+static void cut_pending(SheetCompiler *c){
+    SheetState *s = &c->v[c->cur];
+    flush_pending(c, s->t);
+    while(s->npend){ Pending *p = &s->pend[0]; put_at(c, s->t, p->kind, p->ch, p->d1, p->d2, 0); drop_pending(s, 0); }
+}
+
+static void begin_body(SheetCompiler *c, int def, const char *name){
+    SheetState *s = &c->v[c->cur];
+    int k;
+    Body *b;
+    if(c->depth == BODY_MAX){ c->err = ERR_NESTING; return; }
+    if((k = score_pattern_new(c->out)) < 0 && def){ c->err = ERR_PATTERNS; return; }
+    cut_pending(c);
+    b = &c->body[c->depth++];
+    b->def = (unsigned char)def; b->t0 = s->t; b->pat = k; b->fill = 0;
+    b->saved = *s;
+    memset(&b->stage, 0, sizeof(b->stage));
+    if(k >= 0){
+        Pattern *pt = &c->out->pat[k];
+        b->fill = 1; pt->nest = 1; pt->tempo = 0;
+        strcpy(pt->name, name);
+    }
+}
+
+/* The tempo changes reps plays of ev (len ticks long) from tick t make,
+   nested calls included, go into the voice's map as the player will apply
+   them, so what follows the call is timed at the tempo it plays at */
+static void carry_tempo(SheetState *s, const Pattern *pat, const EvBuf *ev, unsigned long len, unsigned long t, unsigned reps){
+    EvReader r;
+    Event e;
+    for(; reps; reps--, t += len)
+        for(ev_reader_init(&r, ev); ev_read(&r, &e); ){
+            if(e.kind == EV_TEMPO){ tempo_set(&s->tm, t + e.t, &e); s->tempo_bpm = e.w; s->beat = (beat_t)e.d1; }
+            else if(e.kind == EV_CALL && pat[e.d1].tempo) carry_tempo(s, pat, &pat[e.d1].ev, pat[e.d1].len, t + e.t, e.w);
+        }
+}
+
+/* A call the player could not nest that deep, or a staged repeat: the
+   events are written out from the cursor instead, played reps times,
+   transposed and on the voice's channel as the call would have played
+   them. Their own calls stay calls, one level up. */
+static void expand_events(SheetCompiler *c, const EvBuf *ev, unsigned long len, int tr, unsigned reps){
+    SheetState *s = &c->v[c->cur];
+    unsigned long t = s->t;
+    EvReader r;
+    Event e;
+    for(; reps; reps--, t += len)
+        for(ev_reader_init(&r, ev); ev_read(&r, &e); ){
+            int n = e.kind == EV_CALL ? (signed char)e.d2 : e.d1;
+            if(e.kind == EV_NOTE_ON || e.kind == EV_NOTE_OFF){ n += tr; e.d1 = (unsigned char)(n < 0 ? 0 : n > 127 ? 127 : n); }
+            else if(e.kind == EV_CALL){ n += tr; e.d2 = (unsigned char)(signed char)(n < -127 ? -127 : n > 127 ? 127 : n); }
+            put_at(c, t + e.t, e.kind, s->ch, e.d1, e.d2, e.w);
+        }
+}
+
+/* play pattern k reps times from the cursor */
+static void call_pattern(SheetCompiler *c, unsigned k, int tr, unsigned reps){
+    SheetState *s = &c->v[c->cur];
+    Pattern *pat = c->out->pat, *host = host_pattern(c);
+    unsigned nest = pat[k].nest + 1U;
+    cut_pending(c);
+    if(!reps) return;
+    if(host && nest > PAT_DEPTH - 1){ expand_events(c, &pat[k].ev, pat[k].len, tr, reps); nest--; }
+    else put_at(c, s->t, EV_CALL, s->ch, (unsigned char)k, (unsigned char)(signed char)tr, reps);
+    if(host){ if(nest > host->nest) host->nest = (unsigned char)nest; host->tempo |= pat[k].tempo; }
+    if(pat[k].tempo) carry_tempo(s, pat, &pat[k].ev, pat[k].len, s->t, reps);
+    s->t += (unsigned long)reps * pat[k].len;
+    if(s->sustain) s->held = 1;
+}
+
+/* Close the innermost body: a repeat is replaced by a call that plays it
+   reps times (a staged one is written out reps times), a definition leaves
+   the voice where it was */
+static void end_body(SheetCompiler *c, unsigned reps){
+    SheetState *s = &c->v[c->cur];
+    unsigned long len;
+    Body *b;
+    if(!c->depth) return;
+    b = &c->body[c->depth - 1];
+    cut_pending(c);
+    len = s->t - b->t0;
+    if(b->fill){ c->out->pat[b->pat].len = len; c->out->pat[b->pat].done = 1; }
+    c->depth--;
+    if(b->def){ *s = b->saved; return; }
+    s->t = b->t0;                            /* the call replays its tempo changes from there */
+    s->tm = b->saved.tm; s->tempo_bpm = b->saved.tempo_bpm; s->beat = b->saved.beat;
+    if(b->pat >= 0){ call_pattern(c, (unsigned)b->pat, 0, reps); return; }
+    expand_events(c, &b->stage, len, 0, reps);
+    carry_tempo(s, c->out->pat, &b->stage, len, s->t, reps);
+    s->t += (unsigned long)reps * len;
+    if(s->sustain) s->held = 1;
+    if(b->stage.full) c->dst[c->cur].full = 1;
+    evbuf_free(&b->stage);
+}
+
+/* latest complete pattern of that name, -1 if none */
+static int find_pattern(const SheetCompiler *c, const char *name){
+    unsigned k, i;
+    if(!*name) return -1;
+    for(k = c->out->npat; k-- > 0; ) if(strcmp(c->out->pat[k].name, name) == 0){
+        for(i=0;i<c->depth;i++) if(c->body[i].pat == (int)k) return -1;   /* still being defined */
+        return c->out->pat[k].done ? (int)k : -1;
+    }
+    return -1;
+}
+
+static const char *read_name(const char *p, char *name){
+    unsigned n = 0;
+    while(isalnum(*p) || *p=='_'){ if(n < PAT_NAME-1) name[n++] = *p; p++; }
+    name[n] = 0;
+    return p;
+}
+
+/* optional " xN" after :| or a reference */
+static const char *read_times(const char *p, unsigned *reps){
+    const char *q = skip_blank(p);
+    if((*q=='x' || *q=='X') && isdigit(q[1])){
+        unsigned v = 0; q++;
+        while(isdigit(*q)){ if(v < 1000) v = v*10 + (unsigned)(*q-'0'); q++; }
+        *reps = v > 999 ? 999 : v;
+        return q;
+    }
+    return p;
+}
+
+/* End of the sheet: every voice plays out its deferred events, and its
+   length runs to the last of them */
+static void finish_voices(SheetCompiler *c){
+    unsigned v;
+    for(v=0; v<MAX_VOICES; v++) if(c->used[v]){
+        SheetState *s = &c->v[v];
+        c->cur = v;
+        if(s->npend && s->pend[s->npend-1].t > s->t) s->t = s->pend[s->npend-1].t;
+        flush_pending(c, s->t);
+    }
+}
+
+/* First use of a voice: it starts at time 0 with the current voice's tempo,
+   beat and overlap, pedal up, on the channel matching its number. Each voice
+   keeps its own tempo map, so an inherited tempo goes into its stream. */
+static void switch_voice(SheetCompiler *c, unsigned v){
+    if(!c->used[v]){
+        SheetState *s = &c->v[v];
+        *s = c->v[c->cur];
+        s->t = 0; s->sustain = 0; s->ch = (unsigned char)v;
+        s->held = 0; s->npend = 0;
+        tempo_init(&s->tm, SCORE_PPQ);
+        c->used[v] = 1;
+        if(v >= c->out->nv) c->out->nv = v + 1;
+        c->out->met |= 1U << v;
+        c->cur = v;
+        if(s->tempo_bpm != 120 || s->beat != BEAT_Q) set_tempo(c);
+    }
+    c->cur = v;
+}
+
+/* Optional <dur><.> after a note, rest or chord */
+static const char *read_dur(const char *p, unsigned long *dur){
+    char d='q'; int dotted=0;
+    if(*p){ char c=(char)tolower(*p); if(strchr("whqes",c)){ d=c; p++; } }
+    if(*p=='.'){ dotted=1; p++; }
+    *dur = dur_ticks(d,dotted);
+    return p;
+}
+
+/* Inside [..]: one note per step. A chord ends at ']', at the end of its
+   line, or once it holds 8 notes */
+static const char *chord_step(SheetCompiler *c, const char *p){
+    int adv=0, midi;
+    unsigned long dur;
+    p = skip_blank(p);
+    if(!*p) return p;                        /* window end: more next step */
+    if(*p!=']' && *p!='\n' && c->nmids<8){
+        midi = note_from_name(p,&adv);
+        if(midi>=0){ c->mids[c->nmids++]=(unsigned char)midi; p+=adv; }
+        else { while(*p && !isspace(*p) && *p!=']') p++; }
+        return p;
+    }
+    if(*p==']') p++;
+    c->in_chord = 0;
+    p = read_dur(skip_blank(p), &dur);
+    if(c->nmids>0) emit_notes(c, c->mids, c->nmids, dur);
+    return p;
+}
+
+/* Compile the next item in the window; returns 0 once the sheet is used up */
+static int compile_step(SheetCompiler *c, Lexer *lx){
+    const char *p0 = lex_fill(lx), *p = p0;
+    SheetState *s = &c->v[c->cur];
+    if(c->err) return 0;
+    if(!*p){
+        /* an unclosed chord at the very end still plays, as a quarter */
+        if(c->in_chord){ c->in_chord = 0; if(c->nmids>0) emit_notes(c, c->mids, c->nmids, dur_ticks('q',0)); }
+        while(c->depth) end_body(c, 1);      /* unclosed: a repeat plays once */
+        finish_voices(c);
+        return 0;
+    }
+
+    if(c->skipping){
+        while(*p && !isspace(*p) && *p!='|') p++;
+        c->skipping = (*p == 0);
+    }
+    else if(c->in_chord) p = chord_step(c, p);
+    /* Repeat: |: ... :| xN (twice without xN) */
+    else if(p[0]=='|' && p[1]==':'){ p+=2; begin_body(c, 0, ""); }
+    else if(p[0]==':' && p[1]=='|'){
+        unsigned reps = 2;
+        p = read_times(p+2, &reps);
+        if(c->depth && !c->body[c->depth-1].def) end_body(c, reps);
+    }
+    else if(*p=='|') p++;
+    /* Pattern: P=name { ... } compiles without playing; @name[+n|-n] [xN] plays it */
+    else if( (p[0]=='P'||p[0]=='p') && p[1]=='=' ){
+        char name[PAT_NAME];
+        p = skip_ws(read_name(p+2, name));
+        if(*p=='{'){ p++; begin_body(c, 1, name); }
+    }
+    else if(*p=='}'){
+        p++;
+        if(c->depth && c->body[c->depth-1].def) end_body(c, 0);
+    }
+    else if(*p=='@'){
+        char name[PAT_NAME];
+        int tr = 0, k;
+        unsigned reps = 1;
+        p = read_name(p+1, name);
+        if(*p=='+' || *p=='-'){
+            int neg = (*p++ == '-');
+            while(isdigit(*p)){ if(tr < 128) tr = tr*10 + (*p-'0'); p++; }
+            if(tr > 127) tr = 127;
+            if(neg) tr = -tr;
+        }
+        p = read_times(p, &reps);
+        if((k = find_pattern(c, name)) >= 0) call_pattern(c, (unsigned)k, tr, reps);
+    }
+    else if(isspace(*p)) p=skip_ws(p);
+
+    /* Voice: V=n (0..7), each with its own clock, channel, I=, SUS=, OVL= */
+    else if( (p[0]=='V'||p[0]=='v') && p[1]=='=' ){
+        unsigned v=0; p+=2; while(isdigit(*p)){ v=v*10+(*p-'0'); p++; }
+        if(v<MAX_VOICES && !c->depth) switch_voice(c, v);   /* a pattern stays in its voice */
+    }
+    /* Channel of the current voice: CH=n (0..15) */
+    else if( (p[0]=='C'||p[0]=='c') && (p[1]=='H'||p[1]=='h') && p[2]=='=' ){
+        unsigned v=0; p+=3; while(isdigit(*p)){ v=v*10+(*p-'0'); p++; }
+        if(v<16) s->ch = (unsigned char)v;
+    }
+    /* Tempo: T=### (beats per chosen beat unit) */
+    else if( (p[0]=='T'||p[0]=='t') && p[1]=='=' ){
+        unsigned v=0; p+=2; while(isdigit(*p)){ v=v*10+(*p-'0'); p++; }
+        if(v>0 && v<800){ s->tempo_bpm = v; set_tempo(c); }
+    }
+    /* Beat unit: B=Q|E|H|W|S|DQ */
+    else if( (p[0]=='B'||p[0]=='b') && p[1]=='=' ){
+        p+=2;
+        if( (p[0]=='D'||p[0]=='d') && (p[1]=='Q'||p[1]=='q') ){
+            s->beat = BEAT_DQ; p+=2;
+        } else {
+            char u = (char)toupper(*p);
+            if(u=='Q') s->beat=BEAT_Q;
+            else if(u=='E') s->beat=BEAT_E;
+            else if(u=='H') s->beat=BEAT_H;
+            else if(u=='W') s->beat=BEAT_W;
+            else if(u=='S') s->beat=BEAT_S;
+            if(*p) p++;
+        }
+        set_tempo(c);
+    }
+    /* Instrument: I=### */
+    else if( (p[0]=='I'||p[0]=='i') && p[1]=='=' ){
+        unsigned v=0; p+=2; while(isdigit(*p)){ v=v*10+(*p-'0'); p++; }
+        if(v<128) put(c, EV_PROG, (unsigned char)v, 0, 0);
+    }
+    /* Sustain pedal: SUS=ON|OFF */
+    else if( (p[0]=='S'||p[0]=='s') && (p[1]=='U'||p[1]=='u') && (p[2]=='S'||p[2]=='s') && p[3]=='=' ){
+        p+=4;
+        if( (p[0]=='O'||p[0]=='o') && (p[1]=='N'||p[1]=='n') ){ if(!s->sustain){ s->sustain=1; s->held=0; put(c, EV_CC, 64, 127, 0); } p+=2; }
+        else if( (p[0]=='O'||p[0]=='o') && (p[1]=='F'||p[1]=='f') && (p[2]=='F'||p[2]=='f') ){ s->sustain=0; s->held=0; put(c, EV_CC, 64, 0, 0); p+=3; }
+    }
+    /* Overlap: OVL=ms */
+    else if( (p[0]=='O'||p[0]=='o') && (p[1]=='V'||p[1]=='v') && (p[2]=='L'||p[2]=='l') && p[3]=='=' ){
+        unsigned v=0; p+=4; while(isdigit(*p)){ v=v*10+(*p-'0'); p++; }
+        if(v<=200){ s->overlap_ms = (unsigned)v; put(c, EV_OVL, 0, 0, v); } /* clamp */
+    }
+    /* Rest: R<dur><.> */
+    else if(*p=='R' || *p=='r'){
+        unsigned long dur;
+        p = read_dur(p+1, &dur);
+        s->t += dur;
+    }
+    /* Chord: [notes] <dur> <.> */
+    else if(*p=='['){ p++; c->in_chord = 1; c->nmids = 0; }
+    else {
+        /* Single note: Name[#|b]Oct <dur><.> */
+        int adv=0; int midi = note_from_name(p,&adv);
+        if(midi>=0){
+            unsigned long dur;
+            unsigned char note = (unsigned char)midi;
+            p = read_dur(p+adv, &dur);
+            emit_notes(c, &note, 1, dur);
+        }
+        /* Unknown token: skip to next space/bar */
+        else {
+            while(*p && !isspace(*p) && *p!='|') p++;
+            c->skipping = (*p == 0);
+        }
+    }
+    lx->i += (unsigned)(p - p0);
+    return 1;
+}
+
+static void compiler_init(SheetCompiler *c, Score *out, EvBuf *dst){
+    memset(c->used, 0, sizeof(c->used));
+    c->out = out; c->dst = dst; c->cur = 0;
+    c->nmids = 0; c->in_chord = 0; c->skipping = 0;
+    c->depth = 0; c->err = 0;
+    sheet_state_reset(&c->v[0]);
+    c->used[0] = 1; out->met |= 1;
+}
+
+/* repeats still staged when compiling stopped early */
+static void compiler_free(SheetCompiler *c){
+    while(c->depth) evbuf_free(&c->body[--c->depth].stage);
+}
+
+/* end of the longest voice, once the whole sheet has been read: in ms on
+   each voice's own tempo map, and in ticks */
+static unsigned long compiler_len(const SheetCompiler *c){
+    unsigned long len = 0, ms; unsigned v;
+    for(v=0; v<MAX_VOICES; v++) if(c->used[v] && (ms = tempo_ms(&c->v[v].tm, c->v[v].t)) > len) len = ms;
+    return len;
+}
+static unsigned long compiler_ticks(const SheetCompiler *c){
+    unsigned long n = 0; unsigned v;
+    for(v=0; v<MAX_VOICES; v++) if(c->used[v] && c->v[v].t > n) n = c->v[v].t;
+    return n;
+}
+
+/* Compile a whole sheet into out, one event stream per voice;
+   returns the sheet length in ms (the longest voice). A refused sheet
+   leaves out empty but for the reason, in out->err. */
+unsigned long compile_sheet(FILE *f, Score *out){
+    SheetCompiler *c = (SheetCompiler*)malloc(sizeof(SheetCompiler));   /* too big for a DOS stack */
+    Lexer *lx = (Lexer*)malloc(sizeof(Lexer));
+    memset(out, 0, sizeof(*out));
+    out->nv = 1; out->ppq = SCORE_PPQ;
+    if(!lx || !c){ free(lx); free(c); return 0; }
+    compiler_init(c, out, out->v);
+    lex_open(lx, f, ftell(f));
+    while(compile_step(c, lx)) ;
+    out->len = compiler_len(c); out->ticks = compiler_ticks(c);
+    if(c->err){ score_free(out); out->nv = 1; out->ppq = SCORE_PPQ; out->err = c->err; }
+    compiler_free(c);
+    free(lx); free(c);
+    return out->len;
+}
+
+/* ===== Streaming playback ===== */
+/* One lexer and one compiler read the file once. Their events are sorted
+   into a staging buffer per voice, and a voice whose window has played out
+   gets what was staged for it: up to SHEET_WINDOW events, or fewer once the
+   file has moved on to another voice (it is read on until the voice has
+   some). Only the header is read ahead: the voices it names (V=n before
+   the first note) get their first window up front, however far into the
+   file that is. Any other voice is opened as the file reaches it, which is
+   on time when the voices take turns, and late when one is written out
+   after a long stretch of another. Memory stays flat when the voices take turns in the file, bar by bar or
+   line by line. A voice written after another one in a long stretch makes
+   the first one's events wait in staging until the player gets to them: at
+   worst the whole score, as a full load. */
+#define SHEET_WINDOW 64
+
+typedef struct {
+    FILE *f;
+    Lexer lx;
+    SheetCompiler c;
+    EvBuf stage[MAX_VOICES];
+    unsigned char done;
+} SheetSource;
+
+/* voice v's next window; 0 once it has nothing left */
+static int sheet_refill(Score *sc, unsigned v){
+    SheetSource *src = (SheetSource*)sc->src;
+    EvBuf t;
+    while(!src->done && src->stage[v].n < SHEET_WINDOW && !(src->stage[v].n && src->c.cur != v)){
+        if(!compile_step(&src->c, &src->lx)){
+            src->done = 1;
+            sc->len = compiler_len(&src->c); sc->ticks = compiler_ticks(&src->c);
+            sc->err = src->c.err;
+        }
+    }
+    /* the staged events become the window, the old window's blocks stage the next */
+    evbuf_clear(&sc->v[v]);
+    t = sc->v[v]; sc->v[v] = src->stage[v]; src->stage[v] = t;
+    return sc->v[v].n > 0;
+}
+
+static void sheet_release(Score *sc){
+    SheetSource *src = (SheetSource*)sc->src;
+    unsigned v;
+    for(v=0; v<MAX_VOICES; v++) evbuf_free(&src->stage[v]);
+    compiler_free(&src->c);
+    fclose(src->f);
+    free(src);
+}
+
+/* Voices the header names: V=n up to the first note, rest, chord, bar,
+   call or pattern, so reading it takes the same time for any length of
+   sheet. A header line such as "V=1 V=0" opens voice 1 before voice 0's
+   notes. */
+static unsigned sheet_header(Lexer *lx){
+    unsigned mask = 0;
+    for(;;){
+        const char *p = skip_ws(lex_fill(lx));
+        int adv;
+        if(!*p || note_from_name(p, &adv) >= 0 || strchr("Rr[@|{Pp", *p)) break;
+        if((p[0]=='V'||p[0]=='v') && p[1]=='=' && isdigit(p[2])){
+            unsigned v=0; p+=2;
+            while(isdigit(*p)){ v=v*10+(*p-'0'); p++; }
+            if(v<MAX_VOICES) mask |= 1U << v;
+        }
+        while(*p && !isspace(*p)) p++;
+        lx->i = (unsigned)(p - lx->buf);
+    }
+    return mask;
+}
+
+/* Open a sheet for streaming playback: the file is compiled until voice 0
+   and the voices in the header have their first window; the rest as the
+   player gets to it. 0 if it cannot be read or is refused at once
+   (out->err says why). */
+int sheet_stream_open(const char *path, Score *out){
+    SheetSource *src;
+    unsigned v;
+    memset(out, 0, sizeof(*out));
+    if((src = (SheetSource*)malloc(sizeof(SheetSource))) == 0) return 0;
+    memset(src, 0, sizeof(*src));
+    if((src->f = fopen(path, "rt")) == 0){ free(src); return 0; }
+    out->src = src; out->refill = sheet_refill; out->release = sheet_release; out->ppq = SCORE_PPQ;
+    out->nv = 1;
+    compiler_init(&src->c, out, src->stage);
+    lex_open(&src->lx, src->f, 0L);
+    out->met |= sheet_header(&src->lx);
+    for(v=0; v<MAX_VOICES; v++) if(out->met & (1U<<v)) out->nv = v + 1;
+    lex_open(&src->lx, src->f, 0L);
+    for(v=0; v<MAX_VOICES; v++) if(out->met & (1U<<v)) sheet_refill(out, v);
+    if(out->err && !score_events(out)){ score_free(out); return 0; }
+    return 1;
+}
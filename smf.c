@@ -0,0 +1,249 @@
+/* Standard MIDI File export / import for the event timeline */
+#include <stdio.h>
+#include <stdlib.h>  /* malloc, free */
+#include <string.h>  /* memcmp, memset, strrchr */
+#include <ctype.h>   /* tolower */
+#include "music3.h"
+
+/* Export keeps the score's ticks and tempo changes when all its voices
+   share one tempo map (as a .mid must); voices with tempos of their own are
+   written at 500 ticks per quarter and 120 bpm, one tick to a millisecond. */
+#define SMF_DIVISION   500U
+#define SMF_TEMPO_US   500000UL
+#define SMF_MAX_BYTES  0xF000U           /* whole file is read into the near heap */
+#define SMF_MAX_TRACKS 16
+
+static void smf_put_be(FILE *f, unsigned long v, int bytes){
+    while(bytes--) fputc((int)((v >> (bytes*8)) & 0xFF), f);
+}
+/* variable-length quantity, returns bytes written */
+static unsigned smf_put_vlq(FILE *f, unsigned long v){
+    unsigned char b[5]; int n = 0; unsigned len;
+    b[n++] = (unsigned char)(v & 0x7F);
+    while((v >>= 7) != 0) b[n++] = (unsigned char)(0x80 | (v & 0x7F));
+    len = (unsigned)n;
+    while(n--) fputc(b[n], f);
+    return len;
+}
+
+static unsigned smf_put_tempo(FILE *f, unsigned long delta, unsigned long us){
+    unsigned n = smf_put_vlq(f, delta);
+    fputc(0xFF, f); fputc(0x51, f); fputc(3, f); smf_put_be(f, us, 3);
+    return n + 6;
+}
+
+/* next tempo change of a cursor's voices: *us is the tempo so far */
+static int smf_tempo_change(ScoreCursor *c, unsigned long *us, unsigned long *tick){
+    const Event *e;
+    for(; (e = score_cursor_peek(c)) != 0; score_cursor_next(c)) if(e->kind == EV_TEMPO && tempo_us(e) != *us){
+        *us = tempo_us(e); *tick = score_cursor_tick(c);
+        score_cursor_next(c);
+        return 1;
+    }
+    return 0;
+}
+
+/* 1 if every voice with events changes tempo at the same ticks to the same us */
+static int smf_one_tempo_map(Score *sc){
+    ScoreCursor *a = (ScoreCursor*)malloc(sizeof(ScoreCursor)), *b = (ScoreCursor*)malloc(sizeof(ScoreCursor));
+    unsigned v, first = MAX_VOICES;
+    int same = a && b;
+    for(v=0; v<sc->nv && same; v++){
+        unsigned long ua = SMF_TEMPO_US, ub = SMF_TEMPO_US, ta = 0, tb = 0;
+        int ra, rb;
+        if(!sc->v[v].n) continue;
+        if(first == MAX_VOICES){ first = v; continue; }
+        score_cursor_voices(a, sc, 1U << first); score_cursor_voices(b, sc, 1U << v);
+        do {
+            ra = smf_tempo_change(a, &ua, &ta); rb = smf_tempo_change(b, &ub, &tb);
+            if(ra != rb || ua != ub || ta != tb) same = 0;
+        } while(ra && same);
+    }
+    free(a); free(b);
+    return same;
+}
+
+/* One MTrk chunk for a voice, its pattern calls played out; the tempo map
+   only goes into the first track. ticks: the score's own ticks, else ms. */
+static int smf_write_track(FILE *f, Score *sc, unsigned v, int tempo, int ticks){
+    unsigned long len = 0, last = 0, len_pos, us = SMF_TEMPO_US, end = ticks ? sc->ticks : sc->len;
+    unsigned char run = 0;
+    ScoreCursor *cur = (ScoreCursor*)malloc(sizeof(ScoreCursor));   /* too big for a DOS stack */
+    const Event *e;
+    if(!cur) return 0;
+    fputs("MTrk", f); len_pos = (unsigned long)ftell(f); smf_put_be(f, 0, 4);
+
+    if(tempo && !ticks) len += smf_put_tempo(f, 0, SMF_TEMPO_US);   /* one tick = 1 ms */
+    for(score_cursor_voices(cur, sc, 1U << v); (e = score_cursor_peek(cur)) != 0; score_cursor_next(cur)){
+        unsigned long t = ticks ? score_cursor_tick(cur) : e->t;
+        unsigned char st, d[2]; int nd;
+        switch(e->kind){
+            case EV_NOTE_ON:  st = (unsigned char)(0x90 | e->ch); d[0]=e->d1; d[1]=e->d2; nd=2; break;
+            case EV_NOTE_OFF: st = (unsigned char)(0x80 | e->ch); d[0]=e->d1; d[1]=e->d2; nd=2; break;
+            case EV_CC:       st = (unsigned char)(0xB0 | e->ch); d[0]=e->d1; d[1]=e->d2; nd=2; break;
+            case EV_PROG:     st = (unsigned char)(0xC0 | e->ch); d[0]=e->d1; nd=1; break;
+            case EV_TEMPO:
+                if(tempo && ticks && tempo_us(e) != us){ us = tempo_us(e); len += smf_put_tempo(f, t - last, us); last = t; run = 0; }
+                continue;
+            default: continue;            /* overlap is already baked into the times */
+        }
+        len += smf_put_vlq(f, t - last); last = t;
+        if(st != run){ fputc(st, f); len++; run = st; }
+        fwrite(d, 1, (unsigned)nd, f); len += (unsigned)nd;
+    }
+    len += smf_put_vlq(f, end > last ? end - last : 0);
+    fputc(0xFF, f); fputc(0x2F, f); fputc(0, f); len += 3;
+    free(cur);
+
+    fseek(f, (long)len_pos, SEEK_SET); smf_put_be(f, len, 4);
+    fseek(f, 0L, SEEK_END);
+    return !ferror(f);
+}
+
+/* Type 0 for a single voice, otherwise type 1 with one track per voice */
+int smf_write(const char *path, Score *sc){
+    FILE *f = fopen(path, "wb");
+    unsigned v, ntrk = 0, first = 1;
+    int ok = 1, ticks = smf_one_tempo_map(sc) && sc->ppq && sc->ppq < 0x8000U;
+    if(!f) return 0;
+    for(v=0; v<sc->nv; v++) if(sc->v[v].n) ntrk++;
+    if(ntrk == 0) ntrk = 1;
+    fputs("MThd", f); smf_put_be(f, 6, 4);
+    smf_put_be(f, ntrk > 1 ? 1 : 0, 2); smf_put_be(f, ntrk, 2); smf_put_be(f, ticks ? sc->ppq : SMF_DIVISION, 2);
+    for(v=0; v<sc->nv && ok; v++){
+        if(!sc->v[v].n) continue;
+        ok = smf_write_track(f, sc, v, first, ticks);
+        first = 0;
+    }
+    if(first) ok = smf_write_track(f, sc, 0, 1, ticks);   /* an empty score still gets its track */
+    if(!ok){ fclose(f); return 0; }
+    return fclose(f) == 0;
+}
+
+typedef struct {
+    const unsigned char *p, *end;
+    unsigned long tick;                  /* absolute tick of the next event */
+    unsigned char run;                   /* running status */
+    unsigned char done;
+} SmfTrack;
+
+static unsigned long smf_get_vlq(SmfTrack *t){
+    unsigned long v = 0; int i;
+    for(i=0;i<4 && t->p < t->end;i++){ unsigned char b = *t->p++; v = (v<<7) | (b & 0x7F); if(!(b & 0x80)) break; }
+    return v;
+}
+static unsigned long smf_be(const unsigned char *p, int bytes){ unsigned long v=0; while(bytes--) v = (v<<8) | *p++; return v; }
+static void smf_next_delta(SmfTrack *t){
+    if(t->p >= t->end){ t->done = 1; return; }
+    t->tick += smf_get_vlq(t);
+}
+
+/* Decode one event of track t into voice v at its tick. A tempo change
+   goes into every voice, since each plays on its own tempo map. */
+static void smf_decode(SmfTrack *t, Score *sc, unsigned v, TempoMap *tm){
+    EvBuf *out = &sc->v[v];
+    unsigned char st, d1 = 0, d2 = 0;
+    if(t->p >= t->end){ t->done = 1; return; }
+    st = *t->p;
+    if(st & 0x80) t->p++; else st = t->run;       /* running status */
+    if(st == 0xFF){                                /* meta */
+        unsigned char type; unsigned long len;
+        if(t->p >= t->end){ t->done = 1; return; }
+        type = *t->p++; len = smf_get_vlq(t);
+        if((unsigned long)(t->end - t->p) < len){ t->done = 1; return; }
+        if(type == 0x51 && len == 3 && smf_be(t->p, 3)){
+            Event e;
+            unsigned k;
+            e.kind = EV_TEMPO; e.d1 = BEAT_US; e.d2 = t->p[0]; e.w = (unsigned short)smf_be(t->p+1, 2);
+            tempo_set(tm, t->tick, &e);
+            for(k=0; k<sc->nv; k++) ev_push(&sc->v[k], t->tick, EV_TEMPO, 0, e.d1, e.d2, e.w);
+        }
+        if(type == 0x2F) t->done = 1;
+        t->p += (unsigned)len;
+        return;
+    }
+    if(st == 0xF0 || st == 0xF7){                  /* sysex: skipped */
+        unsigned long len = smf_get_vlq(t);
+        if((unsigned long)(t->end - t->p) < len){ t->done = 1; return; }
+        t->p += (unsigned)len;
+        return;
+    }
+    if(!(st & 0x80)){ t->done = 1; return; }      /* data byte with no status: corrupt */
+    t->run = st;
+    if(t->p < t->end) d1 = *t->p++;
+    if((st & 0xE0) != 0xC0 && t->p < t->end) d2 = *t->p++;   /* Cn/Dn carry one data byte */
+    switch(st & 0xF0){
+        case 0x90: if(d2){ ev_push(out, t->tick, EV_NOTE_ON, (unsigned char)(st&0x0F), d1, d2, 0); break; } /* fall through */
+        case 0x80: ev_push(out, t->tick, EV_NOTE_OFF, (unsigned char)(st&0x0F), d1, 64, 0); break;
+        case 0xB0: ev_push(out, t->tick, EV_CC,   (unsigned char)(st&0x0F), d1, d2, 0); break;
+        case 0xC0: ev_push(out, t->tick, EV_PROG, (unsigned char)(st&0x0F), d1, 0, 0); break;
+        default: break;                    /* aftertouch / pitch bend are not played */
+    }
+}
+
+/* Load a type 0/1 file: the events keep the file's ticks and division,
+   tracks are walked in tick order so every voice gets the tempo map, and
+   track i lands in voice i (the last voice takes any overflow).
+   Returns the length in ms, or 0 with no events on a bad file. */
+unsigned long smf_read(FILE *f, Score *out){
+    unsigned char *buf; unsigned size, ntrk = 0, division, pos;
+    SmfTrack trk[SMF_MAX_TRACKS];
+    TempoMap tm;
+    unsigned long tick = 0;
+
+    fseek(f, 0L, SEEK_END);
+    if(ftell(f) > (long)SMF_MAX_BYTES){ return 0; }
+    size = (unsigned)ftell(f); fseek(f, 0L, SEEK_SET);
+    if(size < 14 || (buf = (unsigned char*)malloc(size)) == 0) return 0;
+    if(fread(buf, 1, size, f) != size || memcmp(buf, "MThd", 4) != 0){ free(buf); return 0; }
+    division = (unsigned)smf_be(buf+12, 2);
+    if(division == 0 || (division & 0x8000U)){ free(buf); return 0; }   /* SMPTE time not supported */
+
+    for(pos = 8 + (unsigned)smf_be(buf+4, 4); pos + 8 <= size && ntrk < SMF_MAX_TRACKS; ){
+        unsigned long clen = smf_be(buf+pos+4, 4);
+        if(clen > size - pos - 8) clen = size - pos - 8;
+        if(memcmp(buf+pos, "MTrk", 4) == 0){
+            SmfTrack *t = &trk[ntrk++];
+            t->p = buf+pos+8; t->end = t->p + (unsigned)clen; t->tick = 0; t->run = 0; t->done = 0;
+            smf_next_delta(t);
+        }
+        pos += 8 + (unsigned)clen;
+    }
+
+    out->nv = ntrk < MAX_VOICES ? ntrk : MAX_VOICES;
+    out->ppq = division;
+    tempo_init(&tm, division);
+    for(;;){
+        unsigned i, best = ntrk;
+        for(i=0;i<ntrk;i++) if(!trk[i].done && (best == ntrk || trk[i].tick < trk[best].tick)) best = i;
+        if(best == ntrk) break;
+        tick = trk[best].tick;
+        smf_decode(&trk[best], out, best < MAX_VOICES ? best : MAX_VOICES-1, &tm);
+        if(!trk[best].done) smf_next_delta(&trk[best]);
+    }
+    free(buf);
+    out->ticks = tick;
+    out->len = tempo_ms(&tm, tick);
+    return out->len;
+}
+
+int is_midi_path(const char *path){
+    const char *dot = strrchr(path, '.');
+    return dot && (tolower(dot[1])=='m') && (tolower(dot[2])=='i') && (tolower(dot[3])=='d') && dot[4]==0;
+}
+
+/* Sheet or .mid -> score; returns 0 if the file could not be read or the
+   sheet was refused (out->err says why) */
+int load_score(const char *path, Score *out){
+    FILE *f = fopen(path, is_midi_path(path) ? "rb" : "rt");
+    memset(out, 0, sizeof(*out));
+    if(!f) return 0;
+    if(is_midi_path(path)){
+        smf_read(f, out);
+        fclose(f);
+        return score_events(out) > 0;
+    }
+    compile_sheet(f, out);
+    fclose(f);
+    return !out->err;
+}
@@ -0,0 +1,402 @@
+/* Software synth: turns the MIDI byte stream into 16-bit mono PCM.
+   Wavetable voices with per-program ADSR envelopes, the sustain pedal held
+   per channel, and an integer-only mixer, so a render is bit-identical on
+   every run. synth_io() wraps it as a backend that writes a WAV file on a
+   virtual clock.
+*/
+#include <stdio.h>
+#include <string.h>  /* memset */
+#include "music3.h"
+
+/* ===== Wavetables ===== */
+/* quarter sine, Q15, 64 steps per quarter cycle */
+static const short QSINE[65] = {
+      0,  804, 1608, 2410, 3212, 4011, 4808, 5602, 6393, 7179, 7962, 8739, 9512,
+  10278,11039,11793,12539,13279,14010,14732,15446,16151,16846,17530,18204,18868,
+  19519,20159,20787,21403,22005,22594,23170,23731,24279,24811,25329,25832,26319,
+  26790,27245,27683,28105,28510,28898,29268,29621,29956,30273,30571,30852,31113,
+  31356,31580,31785,31971,32137,32285,32412,32521,32609,32678,32728,32757,32767
+};
+static short sine256(unsigned i){
+    i &= 255;
+    if(i < 64)  return QSINE[i];
+    if(i < 128) return QSINE[128 - i];
+    if(i < 192) return (short)-QSINE[i - 128];
+    return (short)-QSINE[256 - i];
+}
+
+/* additive recipes: relative amplitude of harmonics 1..6 */
+#define SYN_WAVES 4
+static const unsigned char HARM[SYN_WAVES][6] = {
+    { 64,  0,  0,  0,  0,  0 },              /* sine: flutes, pads */
+    { 64, 32, 21, 16, 13, 11 },              /* saw-like: strings, brass, leads */
+    { 64,  0, 21,  0, 13,  0 },              /* square-like: reeds, organ-ish */
+    { 64, 24,  0, 12,  0,  6 }               /* bell/piano-ish */
+};
+static short g_wave[SYN_WAVES][256];
+static int g_waves_built = 0;
+
+static long harm_sum(int w, int i){
+    long acc = 0; int h;
+    for(h=0;h<6;h++) if(HARM[w][h]) acc += (long)HARM[w][h] * sine256((unsigned)(i * (h+1)));
+    return acc;
+}
+/* normalised to a peak of 32000; two passes keep the 16-bit stack small */
+static void build_waves(void){
+    int w, i;
+    for(w=0; w<SYN_WAVES; w++){
+        long peak = 1;
+        for(i=0;i<256;i++){ long a = harm_sum(w, i); if(a < 0) a = -a; if(a > peak) peak = a; }
+        for(i=0;i<256;i++) g_wave[w][i] = (short)((harm_sum(w, i) / 256L * 32000L) / (peak / 256L + 1L));   /* |sum| < 2^23: stays in 32 bits */
+    }
+    g_waves_built = 1;
+}
+
+/* phase step (2^32 = one cycle) at 44100 Hz for notes 116..127; lower notes
+   shift down by octaves */
+static const unsigned long STEP44[12] = {
+    647154683UL, 685636503UL, 726406571UL, 769600953UL, 815363807UL, 863847862UL,
+    915214929UL, 969636441UL, 1027294024UL, 1088380105UL, 1153098554UL, 1221665363UL
+};
+
+static unsigned long note_step(const Synth *s, unsigned note){
+    unsigned oct = note >= 116 ? 0 : (116 - note + 11) / 12;
+    unsigned long st = STEP44[note + 12*oct - 116] >> oct;
+    if(st > (0xFFFFFFFFUL >> s->rate_shift)) return 0;    /* above Nyquist: silent */
+    return st << s->rate_shift;
+}
+
+/* ===== Patches: one per GM family (program / 8); channel 10 is drums ===== */
+typedef struct SynPatch { unsigned char wave; unsigned attack_ms, decay_ms; unsigned char sustain; unsigned release_ms; } Patch;
+static const Patch PATCHES[16] = {
+    { 3,   2,  900,  40, 250 },   /* piano */
+    { 3,   1,  500,   0, 200 },   /* chromatic percussion */
+    { 2,   5,   10, 255,  60 },   /* organ */
+    { 1,   2,  600,  30, 150 },   /* guitar */
+    { 0,   3,  400, 120, 100 },   /* bass */
+    { 1,  60,  200, 200, 300 },   /* strings */
+    { 1,  80,  300, 180, 400 },   /* ensemble */
+    { 1,  20,  150, 200, 120 },   /* brass */
+    { 2,  20,  150, 200, 100 },   /* reed */
+    { 0,  30,  100, 220, 150 },   /* pipe */
+    { 1,   5,  100, 220,  80 },   /* synth lead */
+    { 0, 300,  500, 200, 600 },   /* synth pad */
+    { 2,  10,  800,  60, 300 },   /* synth effects */
+    { 3,   2,  700,  20, 200 },   /* ethnic */
+    { 3,   1,  250,   0,  80 },   /* percussive */
+    { 0,  50,  300, 100, 300 }    /* sound effects */
+};
+static const Patch DRUM = { 0xFF, 0, 120, 0, 30 };          /* noise burst */
+
+#define ENV_MAX (1UL << 24)
+#define SYN_TAIL_MS 2000                        /* release tails rendered after the last event */
+enum { ENV_OFF, ENV_ATTACK, ENV_DECAY, ENV_SUSTAIN, ENV_RELEASE };
+
+static unsigned long env_inc(const Synth *s, unsigned ms){
+    unsigned long n = ((unsigned long)ms * s->rate) / 1000UL;
+    return ENV_MAX / (n ? n : 1UL);
+}
+
+/* stealing order: releasing voices before held ones, quietest first */
+static unsigned long steal_rank(const SynVoice *v){ return v->level + (v->stage == ENV_RELEASE ? 0UL : ENV_MAX + 1UL); }
+
+/* ===== Voices ===== */
+void synth_init(Synth *s, unsigned rate){
+    if(!g_waves_built) build_waves();
+    memset(s, 0, sizeof(*s));
+    s->rate = rate >= 44100U ? 44100U : rate >= 22050U ? 22050U : 11025U;
+    s->rate_shift = (unsigned char)(s->rate == 44100U ? 0 : s->rate == 22050U ? 1 : 2);
+    s->noise = 0xACE1U;
+}
+
+static void voice_release(Synth *s, SynVoice *v){
+    v->stage = ENV_RELEASE; v->held = 0;
+    v->inc = env_inc(s, v->patch->release_ms);
+}
+
+static void note_on(Synth *s, unsigned ch, unsigned note, unsigned vel){
+    SynVoice *v = 0, *best = 0;
+    const Patch *p = ch == 9 ? &DRUM : &PATCHES[s->program[ch] >> 3];
+    int i;
+    /* retrigger the same key, else a free voice, else steal the quietest */
+    for(i=0;i<SYN_VOICES;i++){
+        SynVoice *c = &s->v[i];
+        if(c->stage != ENV_OFF && c->ch == ch && c->note == note){ v = c; break; }
+        if(c->stage == ENV_OFF){ if(!v) v = c; continue; }
+        if(!best || steal_rank(c) < steal_rank(best)) best = c;
+    }
+    if(!v){ v = best; s->stolen++; }
+    v->ch = (unsigned char)ch; v->note = (unsigned char)note; v->vel = (unsigned char)vel;
+    v->patch = p; v->held = 0;
+    v->step = note_step(s, note);
+    if(v->stage == ENV_OFF){ v->phase = 0; v->level = 0; }
+    if(p->attack_ms){ v->stage = ENV_ATTACK; v->inc = env_inc(s, p->attack_ms); }
+    else { v->stage = ENV_DECAY; v->level = ENV_MAX; v->inc = env_inc(s, p->decay_ms); }
+}
+
+static void note_off(Synth *s, unsigned ch, unsigned note){
+    int i;
+    for(i=0;i<SYN_VOICES;i++){
+        SynVoice *v = &s->v[i];
+        if(v->stage == ENV_OFF || v->stage == ENV_RELEASE || v->ch != ch || v->note != note || v->held) continue;
+        if(s->pedal & (1U << ch)) v->held = 1;    /* SUS=ON: keeps sounding until the pedal lifts */
+        else voice_release(s, v);
+    }
+}
+
+static void control(Synth *s, unsigned ch, unsigned cc, unsigned val){
+    int i;
+    if(cc == 64){
+        if(val >= 64){ s->pedal |= 1U << ch; return; }
+        s->pedal &= ~(1U << ch);
+        for(i=0;i<SYN_VOICES;i++) if(s->v[i].held && s->v[i].ch == ch) voice_release(s, &s->v[i]);
+    }
+    else if(cc == 120){ for(i=0;i<SYN_VOICES;i++) if(s->v[i].ch == ch) s->v[i].stage = ENV_OFF; }    /* all sound off */
+    else if(cc == 123){ for(i=0;i<SYN_VOICES;i++) if(s->v[i].ch == ch && s->v[i].stage != ENV_OFF && s->v[i].stage != ENV_RELEASE) voice_release(s, &s->v[i]); }
+    else if(cc == 121) s->pedal &= ~(1U << ch);
+}
+
+/* ===== MIDI byte stream in (running status, realtime bytes ignored) ===== */
+void synth_midi(Synth *s, unsigned char b){
+    unsigned ch;
+    if(b >= 0xF8) return;                       /* realtime */
+    if(b & 0x80){ s->status = b >= 0xF0 ? 0 : b; s->nd = 0; return; }
+    if(!s->status) return;                      /* sysex data or no status yet */
+    s->d[s->nd++] = b;
+    ch = s->status & 0x0F;
+    switch(s->status & 0xF0){
+        case 0xC0: s->program[ch] = b; s->nd = 0; return;
+        case 0xD0: s->nd = 0; return;
+    }
+    if(s->nd < 2) return;
+    s->nd = 0;
+    switch(s->status & 0xF0){
+        /* note on with velocity 0 is a note off */
+        case 0x90: if(s->d[1]){ note_on(s, ch, s->d[0], s->d[1]); break; } /* fall through */
+        case 0x80: note_off(s, ch, s->d[0]); break;
+        case 0xB0: control(s, ch, s->d[0], s->d[1]); break;
+        default: break;                         /* aftertouch, pitch bend: not modelled */
+    }
+}
+
+/* ===== Mixer ===== */
+/* envelope moves once per block; the block's gain is fixed inside it */
+static void env_step(const Synth *s, SynVoice *v, unsigned n){
+    unsigned long d = v->inc * n, sus = ((unsigned long)v->patch->sustain << 16);
+    switch(v->stage){
+        case ENV_ATTACK:
+            v->level += d;
+            if(v->level >= ENV_MAX){ v->level = ENV_MAX; v->stage = ENV_DECAY; v->inc = env_inc(s, v->patch->decay_ms); }
+            break;
+        case ENV_DECAY:
+            if(v->level <= sus + d){ v->level = sus; v->stage = sus ? ENV_SUSTAIN : ENV_OFF; }
+            else v->level -= d;
+            break;
+        case ENV_RELEASE:
+            if(v->level <= d){ v->level = 0; v->stage = ENV_OFF; }
+            else v->level -= d;
+            break;
+    }
+}
+
+/* mono 16-bit: each voice adds its samples into mix[] with phase and gain
+   in registers, then mix[] is scaled and clipped once. Envelopes step on
+   absolute SYN_BLOCK boundaries, so the output does not depend on how the
+   render is cut into calls. out == 0 only advances the state (phases,
+   noise, envelopes), far cheaper than mixing. */
+void synth_render(Synth *s, short *out, unsigned n){
+    long mix[SYN_BLOCK];
+    if(!out && synth_active(s) == 0){ s->frames += n; return; }   /* silence: only the clock moves */
+    while(n){
+        unsigned len = SYN_BLOCK - (unsigned)(s->frames % SYN_BLOCK), i;
+        int k;
+        if(len > n) len = n;
+        if(out) memset(mix, 0, sizeof(mix));
+        for(k=0;k<SYN_VOICES;k++){
+            SynVoice *v = &s->v[k];
+            long g;
+            if(v->stage == ENV_OFF) continue;
+            g = (long)((v->level >> 9) * v->vel) >> 7;     /* Q15 envelope x velocity */
+            if(v->patch->wave == 0xFF){
+                unsigned lfsr = s->noise;
+                for(i=0;i<len;i++){
+                    lfsr = (lfsr >> 1) ^ ((lfsr & 1U) ? 0xB400U : 0U);   /* 16-bit Galois LFSR */
+                    if(out) mix[i] += (((long)lfsr - 32768L) * g) >> 15;
+                }
+                s->noise = lfsr;
+            } else if(out){
+                const short *w = g_wave[v->patch->wave];
+                unsigned long ph = v->phase, st = v->step;
+                /* the index depends on i only, no loop-carried state: vectorizes where gathers exist */
+                for(i=0;i<len;i++) mix[i] += ((long)w[(unsigned)((ph + i*st) >> 24) & 0xFF] * g) >> 15;   /* mask: long may be wider than 32 bits */
+                v->phase = ph + len*st;
+            } else v->phase += len * v->step;
+        }
+        if((s->frames + len) % SYN_BLOCK == 0)
+            for(k=0;k<SYN_VOICES;k++) if(s->v[k].stage != ENV_OFF) env_step(s, &s->v[k], SYN_BLOCK);
+        if(out){
+            for(i=0;i<len;i++){
+                long x = mix[i] >> 2;                  /* headroom: about four full voices before clipping */
+                out[i] = (short)(x > 32767L ? 32767L : x < -32768L ? -32768L : x);
+            }
+            out += len;
+        }
+        n -= len;
+        s->frames += len;
+    }
+}
+
+unsigned synth_active(const Synth *s){ unsigned n = 0; int k; for(k=0;k<SYN_VOICES;k++) if(s->v[k].stage != ENV_OFF) n++; return n; }
+
+/* ===== Offline render of a loaded score ===== */
+/* Compiled events straight into the synth: no encoder, no player, no
+   globals, so each thread can render on its own Synth */
+void synth_event(Synth *s, const Event *e){
+    switch(e->kind){
+        case EV_NOTE_ON:  if(e->d2){ note_on(s, e->ch, e->d1, e->d2); break; } /* fall through */
+        case EV_NOTE_OFF: note_off(s, e->ch, e->d1); break;
+        case EV_CC:       control(s, e->ch, e->d1, e->d2); break;
+        case EV_PROG:     s->program[e->ch & 0x0F] = (unsigned char)(e->d1 & 0x7F); break;
+        default: break;
+    }
+}
+
+static unsigned long ms_to_frames(const Synth *s, unsigned long ms){
+    return (ms / 1000UL) * s->rate + ((ms % 1000UL) * s->rate) / 1000UL;
+}
+
+/* move the synth to frame target: state only before from_f, PCM to sink
+   inside [from_f, to_f); returns 0 once to_f is reached */
+static int render_until(Synth *s, unsigned long target, unsigned long from_f, unsigned long to_f,
+                        void (*sink)(void *ctx, const short *pcm, unsigned n), void *ctx){
+    short buf[256];
+    while(s->frames < target){
+        unsigned long left = target - s->frames;
+        unsigned n;
+        if(s->frames >= to_f) return 0;
+        if(s->frames < from_f){
+            if(left > from_f - s->frames) left = from_f - s->frames;
+            n = left > 4096UL ? 4096U : (unsigned)left;
+            synth_render(s, 0, n);
+            continue;
+        }
+        if(left > to_f - s->frames) left = to_f - s->frames;
+        n = left > 256UL ? 256U : (unsigned)left;
+        synth_render(s, buf, n);
+        sink(ctx, buf, n);
+    }
+    return s->frames < to_f;
+}
+
+/* Play sc into a fresh s: frames before from_ms only advance the state, PCM
+   for [from_ms, to_ms) goes to sink; to_ms == 0 runs to the end and the
+   release tail. Cutting a score into ranges and joining them gives the same
+   samples as one render, and the same as the synth_io backend playing it. */
+void synth_render_score(Synth *s, Score *sc, unsigned long from_ms, unsigned long to_ms,
+                        void (*sink)(void *ctx, const short *pcm, unsigned n), void *ctx){
+    ScoreCursor cur;
+    Sounding snd;
+    const Event *e;
+    unsigned long from_f = ms_to_frames(s, from_ms), to_f = to_ms ? ms_to_frames(s, to_ms) : 0xFFFFFFFFUL, ms, end;
+    unsigned ch;
+    score_cursor_init(&cur, sc);
+    snd.n = 0;
+    while((e = score_cursor_peek(&cur)) != 0){
+        if(!render_until(s, ms_to_frames(s, e->t), from_f, to_f, sink, ctx)) return;
+        /* the notes the player would send, through the same table */
+        if(e->kind == EV_NOTE_ON ? sounding_on(&snd, e->ch, e->d1) : e->kind == EV_NOTE_OFF ? sounding_off(&snd, e->ch, e->d1) : 1) synth_event(s, e);
+        score_cursor_next(&cur);
+    }
+    if(!render_until(s, ms_to_frames(s, sc->len), from_f, to_f, sink, ctx)) return;
+    /* what the player sends at the end: all notes off, pedal up */
+    for(ch=0; ch<16; ch++){ control(s, ch, 123, 0); control(s, ch, 64, 0); }
+    for(ms = sc->len, end = sc->len + SYN_TAIL_MS; synth_active(s) && ms < end; ){
+        ms += 10;
+        if(!render_until(s, ms_to_frames(s, ms), from_f, to_f, sink, ctx)) return;
+    }
+}
+
+/* ===== WAV file (16-bit mono PCM) ===== */
+static void put_le(FILE *f, unsigned long v, int bytes){ while(bytes--){ fputc((int)(v & 0xFF), f); v >>= 8; } }
+
+FILE *wav_open(const char *path, unsigned rate){
+    FILE *f = fopen(path, "wb");
+    if(!f) return 0;
+    fputs("RIFF", f); put_le(f, 36, 4); fputs("WAVEfmt ", f);
+    put_le(f, 16, 4); put_le(f, 1, 2); put_le(f, 1, 2);
+    put_le(f, rate, 4); put_le(f, (unsigned long)rate * 2UL, 4); put_le(f, 2, 2); put_le(f, 16, 2);
+    fputs("data", f); put_le(f, 0, 4);
+    return f;
+}
+void wav_write(FILE *f, const short *pcm, unsigned n){
+    unsigned i;
+    for(i=0;i<n;i++) put_le(f, (unsigned long)(unsigned short)pcm[i], 2);
+}
+/* patch the sizes in; returns 0 if anything failed to write */
+int wav_close(FILE *f, unsigned long frames){
+    fseek(f, 4L, SEEK_SET);  put_le(f, 36UL + frames * 2UL, 4);
+    fseek(f, 40L, SEEK_SET); put_le(f, frames * 2UL, 4);
+    if(ferror(f)){ fclose(f); return 0; }
+    return fclose(f) == 0;
+}
+
+/* ===== Backend: the player drives the synth, a virtual clock paces the render ===== */
+static Synth g_syn;
+static FILE *g_wav = 0;
+static unsigned long g_syn_ms = 0;
+
+static void syn_render_to(unsigned long ms){
+    short buf[256];
+    unsigned long target = ms_to_frames(&g_syn, ms);
+    while(g_syn.frames < target){
+        unsigned n = target - g_syn.frames > 256UL ? 256U : (unsigned)(target - g_syn.frames);
+        synth_render(&g_syn, buf, n);
+        if(g_wav) wav_write(g_wav, buf, n);
+    }
+}
+
+static void syn_reset(void){ unsigned rate = g_syn.rate; synth_init(&g_syn, rate); g_syn_ms = 0; }
+static int  syn_ready(void){ return 1; }
+static void syn_write(unsigned char b){ synth_midi(&g_syn, b); }
+static void syn_start(void){}
+static void syn_stop(void){
+    unsigned long end = g_syn_ms + SYN_TAIL_MS;
+    while(synth_active(&g_syn) && g_syn_ms < end){ g_syn_ms += 10; syn_render_to(g_syn_ms); }
+}
+static unsigned long syn_now(void){ return g_syn_ms; }
+static void syn_wait(unsigned long ms){ if((long)(ms - g_syn_ms) > 0){ g_syn_ms = ms; syn_render_to(ms); } }
+static void syn_nop(void){}
+static void syn_cell(unsigned idx, unsigned short cell){ (void)idx; (void)cell; }
+static void syn_close(int row){ (void)row; }
+static int  syn_key(int wait){ return wait ? '\r' : -1; }
+static int  syn_no_kbd(void){ return 0; }
+static int  syn_capture(const char *path){ (void)path; return 0; }
+
+static const M3Io syn_io = {
+    "synth",
+    syn_reset, syn_ready, syn_write,
+    syn_start, syn_stop, syn_now, syn_wait,
+    syn_nop, syn_cell, syn_close,
+    syn_key,
+    syn_no_kbd, syn_nop,
+    syn_capture,
+    syn_no_kbd, syn_nop, syn_capture
+};
+
+/* Backend that renders to a WAV file at rate (11025, 22050 or 44100);
+   0 if the file cannot be created */
+const M3Io *synth_io(const char *wav_path, unsigned rate){
+    synth_init(&g_syn, rate);
+    if((g_wav = wav_open(wav_path, g_syn.rate)) == 0) return 0;
+    g_syn_ms = 0;
+    return &syn_io;
+}
+
+/* after clock_stop: finish the WAV header; returns 0 if the file is bad */
+int synth_io_done(void){
+    int ok;
+    if(!g_wav) return 0;
+    ok = wav_close(g_wav, g_syn.frames);
+    g_wav = 0;
+    return ok;
+}
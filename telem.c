@@ -0,0 +1,110 @@
+/* Playback telemetry: counters and histograms that are always on, an
+   optional status line, and a binary log of the last TM_LOG_MAX events and
+   frames written on exit (summarize it on the host with m3tlog).
+   Log format, all little-endian: "M3TL", u32 version, u32 TM_NCOUNT, the
+   counters (u32 each), TM_HIST lateness then TM_HIST frame buckets (u32),
+   u32 record count, then records of u32 t, u16 value, u8 type, u8 detail.
+*/
+#include <stdio.h>
+#include <string.h>  /* memset */
+#include "music3.h"
+
+volatile unsigned long g_tm[TM_NCOUNT];
+unsigned long g_tm_late_hist[TM_HIST], g_tm_frame_hist[TM_HIST];
+unsigned char g_tm_overlay = 0;
+
+const char *const TM_NAMES[TM_NCOUNT] = {
+    "events", "lateness sum ms", "lateness max ms", "frames", "frame sum ms", "frame max ms",
+    "frames held for events", "frames not needed", "frame rate (last s)",
+    "MPU busy-wait spins", "MPU wait timeouts", "tick busy (UART full)", "tick stalls", "bytes dropped",
+    "bytes overflowed", "timer ISR", "keyboard ISR", "keys lost", "log records lost",
+    "MIDI in bytes", "MIDI in bytes lost", "recorded events lost"
+};
+const char *const TM_BUCKETS[TM_HIST] = { "0", "1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65-128", ">128" };
+
+/* ===== Record ring: only filled while a log is wanted ===== */
+typedef struct { unsigned long t; unsigned short v; unsigned char type, detail; } TmRec;
+static TmRec g_tm_log[TM_LOG_MAX];
+static unsigned g_tm_head = 0, g_tm_n = 0;
+static unsigned char g_tm_logging = 0;
+static unsigned g_base_dropped, g_base_overflow;
+
+/* 0, 1, 2, 3-4, 5-8, ... >128 ms */
+static unsigned tm_bucket(unsigned long v){
+    unsigned b = 0;
+    if(v == 0) return 0;
+    for(v--; v && b < TM_HIST - 2; v >>= 1) b++;
+    return b + 1;
+}
+
+static void tm_rec(unsigned char type, unsigned char detail, unsigned long t, unsigned long v){
+    TmRec *r;
+    if(!g_tm_logging) return;
+    if(g_tm_n == TM_LOG_MAX) g_tm[TM_LOG_LOST]++; else g_tm_n++;
+    r = &g_tm_log[g_tm_head];
+    r->t = t; r->v = (unsigned short)(v > 0xFFFFUL ? 0xFFFFU : v); r->type = type; r->detail = detail;
+    if(++g_tm_head == TM_LOG_MAX) g_tm_head = 0;
+}
+
+void telem_reset(int log){
+    memset((void*)g_tm, 0, sizeof(g_tm));
+    memset(g_tm_late_hist, 0, sizeof(g_tm_late_hist));
+    memset(g_tm_frame_hist, 0, sizeof(g_tm_frame_hist));
+    g_tm_head = g_tm_n = 0; g_tm_logging = (unsigned char)(log != 0);
+    g_base_dropped = g_tx_dropped; g_base_overflow = g_tx_overflow;
+}
+
+void telem_event(unsigned char kind, unsigned long t, unsigned long late){
+    g_tm[TM_EVENTS]++; g_tm[TM_LATE_SUM] += late;
+    if(late > g_tm[TM_LATE_MAX]) g_tm[TM_LATE_MAX] = late;
+    g_tm_late_hist[tm_bucket(late)]++;
+    tm_rec(TM_REC_EVENT, kind, t, late);
+}
+
+void telem_frame(unsigned long t, unsigned long ms){
+    g_tm[TM_FRAMES]++; g_tm[TM_FRAME_SUM] += ms;
+    if(ms > g_tm[TM_FRAME_MAX]) g_tm[TM_FRAME_MAX] = ms;
+    g_tm_frame_hist[tm_bucket(ms)]++;
+    tm_rec(TM_REC_FRAME, 0, t, ms);
+}
+
+/* the output counters live in midiout.c: take the deltas */
+static void telem_sync(void){
+    g_tm[TM_TX_DROPPED] = (unsigned)(g_tx_dropped - g_base_dropped);
+    g_tm[TM_TX_OVERFLOW] = (unsigned)(g_tx_overflow - g_base_overflow);
+}
+
+/* One line for the bottom row while playing */
+void telem_overlay(void){
+    char buf[192];                           /* twelve counters at full width */
+    unsigned long n = g_tm[TM_EVENTS];
+    telem_sync();
+    sprintf(buf, "late %lu.%lu/%lu >8ms %lu | frame %lu/s max %lu held %lu | MPU to %lu stall %lu drop %lu ovf %lu",
+        n ? g_tm[TM_LATE_SUM]/n : 0UL, n ? (g_tm[TM_LATE_SUM]*10UL/n)%10UL : 0UL, g_tm[TM_LATE_MAX],
+        g_tm_late_hist[5] + g_tm_late_hist[6] + g_tm_late_hist[7] + g_tm_late_hist[8] + g_tm_late_hist[9],
+        g_tm[TM_FRAME_RATE], g_tm[TM_FRAME_MAX], g_tm[TM_FRAME_SKIP], g_tm[TM_MPU_TIMEOUTS], g_tm[TM_TX_STALLS], g_tm[TM_TX_DROPPED], g_tm[TM_TX_OVERFLOW]);
+    buf[SCR_W - 1] = 0;
+    scr_puts(1, SCR_H, buf);
+}
+
+/* ===== Binary log ===== */
+static void put_u32(FILE *f, unsigned long v){ fputc((int)(v & 0xFF), f); fputc((int)((v >> 8) & 0xFF), f); fputc((int)((v >> 16) & 0xFF), f); fputc((int)((v >> 24) & 0xFF), f); }
+
+int telem_write(const char *path){
+    FILE *f = fopen(path, "wb");
+    unsigned i, k;
+    if(!f) return 0;
+    telem_sync();
+    fputs("M3TL", f); put_u32(f, TM_VERSION); put_u32(f, TM_NCOUNT);
+    for(i=0;i<TM_NCOUNT;i++) put_u32(f, g_tm[i]);
+    for(i=0;i<TM_HIST;i++) put_u32(f, g_tm_late_hist[i]);
+    for(i=0;i<TM_HIST;i++) put_u32(f, g_tm_frame_hist[i]);
+    put_u32(f, g_tm_n);
+    /* oldest first */
+    for(i=0, k = (g_tm_head + TM_LOG_MAX - g_tm_n) % TM_LOG_MAX; i<g_tm_n; i++, k = (k + 1) % TM_LOG_MAX){
+        const TmRec *r = &g_tm_log[k];
+        put_u32(f, r->t);
+        fputc(r->v & 0xFF, f); fputc(r->v >> 8, f); fputc(r->type, f); fputc(r->detail, f);
+    }
+    return fclose(f) == 0;
+}
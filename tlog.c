@@ -0,0 +1,87 @@
+/* Host summary of a telemetry log written by `music3 ... -l file.log`:
+   the counters, lateness and frame-time histograms, and the latest events
+   from the record ring with the worst ones listed.
+
+   Usage: m3tlog file.log
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "music3.h"
+
+const M3Io *g_io;                        /* unused: the core is linked for TM_NAMES only */
+
+/* one name per EV_* kind, in enum order; the typedef fails to compile when they disagree */
+static const char *const KIND[] = { "note on", "note off", "cc", "program", "tempo", "overlap", "call" };
+typedef char kind_names_match_enum[sizeof(KIND) / sizeof(KIND[0]) == EV_NKIND ? 1 : -1];
+
+static int get_u32(FILE *f, unsigned long *v){
+    int i, c; *v = 0;
+    for(i=0;i<4;i++){ if((c = fgetc(f)) == EOF) return 0; *v |= (unsigned long)c << (8*i); }
+    return 1;
+}
+
+static void histogram(const char *title, const unsigned long *h){
+    unsigned long total = 0, most = 0;
+    int i;
+    for(i=0;i<TM_HIST;i++){ total += h[i]; if(h[i] > most) most = h[i]; }
+    printf("\n%s (%lu)\n", title, total);
+    if(!total) return;
+    for(i=0;i<TM_HIST;i++){
+        int bar = (int)(h[i] * 50UL / most);
+        printf("  %7s ms %9lu %5.1f%% ", TM_BUCKETS[i], h[i], 100.0 * (double)h[i] / (double)total);
+        while(bar--) putchar('#');
+        putchar('\n');
+    }
+}
+
+typedef struct { unsigned long t; unsigned v; unsigned char type, detail; } Rec;
+
+static int by_value(const void *a, const void *b){
+    const Rec *x = (const Rec*)a, *y = (const Rec*)b;
+    return x->v != y->v ? (x->v < y->v ? 1 : -1) : (x->t < y->t ? -1 : x->t > y->t);
+}
+
+int main(int argc, char **argv){
+    FILE *f;
+    char magic[4];
+    unsigned long ver, ncount, c[TM_NCOUNT], late[TM_HIST], frame[TM_HIST], n, i, nev = 0;
+    Rec *r;
+
+    if(argc != 2){ printf("usage: m3tlog file.log\n"); return 2; }
+    if((f = fopen(argv[1], "rb")) == 0){ printf("%s: cannot open\n", argv[1]); return 1; }
+    if(fread(magic, 1, 4, f) != 4 || magic[0]!='M' || magic[1]!='3' || magic[2]!='T' || magic[3]!='L'
+       || !get_u32(f, &ver) || ver != TM_VERSION || !get_u32(f, &ncount) || ncount != TM_NCOUNT){
+        printf("%s: not a version %d telemetry log\n", argv[1], TM_VERSION); return 1;
+    }
+    for(i=0;i<TM_NCOUNT;i++) if(!get_u32(f, &c[i])) goto short_file;
+    for(i=0;i<TM_HIST;i++) if(!get_u32(f, &late[i])) goto short_file;
+    for(i=0;i<TM_HIST;i++) if(!get_u32(f, &frame[i])) goto short_file;
+    if(!get_u32(f, &n)) goto short_file;
+    if((r = (Rec*)malloc((n ? n : 1) * sizeof(Rec))) == 0){ printf("out of memory\n"); return 1; }
+    for(i=0;i<n;i++){
+        unsigned char b[4];
+        if(!get_u32(f, &r[i].t) || fread(b, 1, 4, f) != 4) goto short_file;
+        r[i].v = b[0] | ((unsigned)b[1] << 8); r[i].type = b[2]; r[i].detail = b[3];
+    }
+    fclose(f);
+
+    printf("%s\n", argv[1]);
+    for(i=0;i<TM_NCOUNT;i++) printf("  %-24s %lu\n", TM_NAMES[i], c[i]);
+    if(c[TM_EVENTS]) printf("  %-24s %.2f\n", "lateness avg ms", (double)c[TM_LATE_SUM] / (double)c[TM_EVENTS]);
+    if(c[TM_FRAMES]) printf("  %-24s %.2f\n", "frame avg ms", (double)c[TM_FRAME_SUM] / (double)c[TM_FRAMES]);
+    histogram("Event lateness", late);
+    histogram("Frame render time", frame);
+
+    /* records: the latest events, worst first */
+    for(i=0;i<n;i++) if(r[i].type == TM_REC_EVENT) r[nev++] = r[i];
+    qsort(r, nev, sizeof(Rec), by_value);
+    printf("\n%lu events in the log%s; the latest, worst first:\n", nev, c[TM_LOG_LOST] ? " (older ones dropped)" : "");
+    for(i=0;i<nev && i<10 && r[i].v;i++)
+        printf("  at %8lu ms  %-8s %5u ms late\n", r[i].t, r[i].detail < EV_NKIND ? KIND[r[i].detail] : "?", r[i].v);
+    free(r);
+    return 0;
+
+short_file:
+    printf("%s: truncated\n", argv[1]);
+    return 1;
+}